@@ -12,26 +12,80 @@ This is a unix-like shell for issuing commands through the terminal.
   are supported.
 
 -------------------*/
+//for CPU affinity and scheduling calls
+#define _GNU_SOURCE
+#include<ctype.h>
 #include<dirent.h>
+#include<dlfcn.h>
+#include<errno.h>
 #include<fcntl.h>
+#include<math.h>
+#include<poll.h>
+#include<pthread.h>
 #include<pwd.h>
+#include<sched.h>
+#include<signal.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<time.h>
 #include<unistd.h>
 
+#include<sys/file.h>
+#include<sys/inotify.h>
+#include<sys/mman.h>
+#include<sys/resource.h>
+#include<sys/signalfd.h>
+#include<sys/stat.h>
+#include<sys/syscall.h>
+#include<sys/timerfd.h>
 #include<sys/types.h>
 #include<sys/wait.h>
 
 #include<readline/readline.h>
 #include<readline/history.h>
 
+#include "myshell_builtin.h"
+
 #define FALSE 0
 #define TRUE 1
 //size of input buffer
 #define BUFF 1024
 //max args in a command
 #define MAX_ARGS 20
+//time between SIGTERM and SIGKILL when a command times out (ms)
+#define KILL_GRACE 2000
+//longest duration parse_duration() accepts, a year (ms)
+#define MAX_DURATION (365L * 24 * 60 * 60 * 1000)
+//size of node masks passed to set_mempolicy()
+#define MAX_NODES 1024
+//memory policy that prefers one node (from linux/mempolicy.h)
+#define MPOL_PREFERRED 1
+//default size limit of the command cache, override with MYSHELL_CACHE_SIZE
+#define CACHE_MAX (64 * 1024 * 1024)
+//marks the start of a cache entry, bump when the format changes
+#define CACHE_MAGIC "MYSHC001"
+//starting value for FNV-1a hashes
+#define FNV_OFFSET 14695981039346656037ULL
+//number of buckets in the builtin table, must be a power of 2
+#define BUILTIN_BUCKETS 64
+//default quiet time before the watch command reruns (ms)
+#define WATCH_DEBOUNCE 100
+//max changed files listed for each rerun
+#define WATCH_REPORT 8
+//inotify events the watch command cares about
+#define WATCH_EVENTS (IN_MODIFY|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF)
+//max bytes a pipestat relay moves per splice() call
+#define RELAY_CHUNK (1024 * 1024)
+//number of buckets in the alias and function tables, must be a power of 2
+#define FUNC_BUCKETS 64
+//max depth of functions calling functions
+#define FUNC_DEPTH 100
+//marks the start of a startup snapshot
+#define SNAP_MAGIC "MYSHSNAP"
+//bump when the snapshot format changes
+#define SNAP_VERSION 2
 
 /*-----------------
 Output Color Codes
@@ -47,27 +101,86 @@ Output Color Codes
 Function Prototypes
 -------------------*/
 
+//defined with the global variables
+struct builtin;
+struct stage;
+struct watch_list;
+struct relay;
+struct alias;
+struct func;
+
 void parse_input(char *input, char *args[MAX_ARGS]);
 void process_input(char *args[MAX_ARGS]);
+void init_builtins();
+struct builtin *find_builtin(char *name);
+struct builtin *add_builtin(char *name);
+void run_plugin(struct builtin *b, char **args, int in, int out, int err);
+int is_plugin(char *name);
+void plugin_redirect(char **args);
+void enable_cmd(char **args);
 void check_IO(char *args[MAX_ARGS]);
 void redirect(char **args);
 void check_background(char *args[MAX_ARGS]);
 void check_pipes(char *args[MAX_ARGS]);
 void piping(char **args);
+void start_stage(struct stage *st, int pfds[][2], int npipes);
+void pipestat_cmd(char **args);
+void pipestat_report(struct relay *relays, int nrelays, struct stage *stages, double seconds, int live);
 void batch_commands(char **args);
 int check_script(char *arg);
 void run_script(char *arg);
 void external_prog(char **args);
+void exec_prog(char **args);
+int wait_child(pid_t pid, long limit, int sig);
+void give_terminal(pid_t pgid);
 char *get_prompt();
 char *get_dir();
 void change_dir(char *newdir);
-void list_dir(char **args);
+void list_dir(char **args, FILE *out);
 void clear();
-void echo(char **args);
-void environ();
+void echo(char **args, FILE *out);
+void environ_cmd(FILE *out);
 void escape();
-void help();
+void help(FILE *out);
 void pause_cmd();
+long parse_duration(char *arg);
+void timeout_cmd(char **args);
+void sched_cmd(char **args);
+int parse_cpulist(char *list, cpu_set_t *set);
+int read_cpulist(char *path, cpu_set_t *set);
+void apply_sched();
+void pick_pipe_cpus(struct stage *stages, int n);
+void pin_cpus(cpu_set_t *set);
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+uint64_t hash_string(uint64_t hash, char *str);
+int hash_file(uint64_t *hash, char *path, int use_mtime);
+int hash_fd(uint64_t *hash, int fd);
+char *cache_dir();
+void cache_cmd(char **args);
+void cache_count(char *dir, int hit);
+void cache_stats(char *dir);
+void cache_evict(char *dir, int clear);
+void copy_fd(int in, int out);
+void watch_cmd(char **args);
+int watch_path(struct watch_list *list, char *path, int recursive);
+void watch_again(struct watch_list *list, int i);
+pid_t watch_start(char **args, int *pidfd);
+void watch_stop(pid_t pid, int pidfd);
+char *snapshot_path();
+int load_snapshot();
+void build_snapshot(char *path);
+void rebuild_snapshot();
+char *lookup_command(char *name);
+char **complete_command(const char *text, int start, int end);
+struct alias *find_alias(char *name);
+struct func *find_func(char *name);
+int is_defined(char *name);
+void alias_cmd(char **args);
+void unalias_cmd(char **args);
+void functions_cmd(char **args);
+int define_function(char *line, FILE *file);
+char *expand_word(char *word, char **params, int nparams);
+void run_function(struct func *f, char **args);
 void shell_loop();
 
 /*-----------------
@@ -80,7 +193,6 @@ int status;
 
 //for pipes
 int piped;
-char **args2;
 
 //for input/output redirection
 int input_redir;
@@ -91,6 +203,158 @@ int append_redir;
 char *input_file;
 char *output_file;
 
+//for command timeouts, in milliseconds (0 = no limit)
+long default_timeout;
+//one-off limit set by the timeout command (-1 = use default)
+long cmd_timeout = -1;
+
+//scheduling settings applied to a command between fork and exec
+struct sched_opts{
+  //TRUE if any setting below was given
+  int active;
+  //CPUs to run on
+  int has_cpus;
+  cpu_set_t cpus;
+  //NUMA node to prefer for memory (-1 = any)
+  int node;
+  //nice value
+  int has_nice;
+  int nice;
+  //io priority class (0 = unchanged) and level
+  int io_class;
+  int io_level;
+  //use SCHED_BATCH
+  int batch;
+};
+//settings for the command being run by the sched command
+struct sched_opts cmd_sched;
+//automatically place the two sides of a pipe on sibling cores
+int sched_auto;
+//where in the CPU order the next pipeline is placed, so pipelines spread out
+int pipe_cpu_next;
+
+//a builtin command, kept in a hash table by name
+struct builtin{
+  char *name;
+  //built into the shell, takes the args array
+  void (*native)(char **args);
+  //for builtins that only write output, a version that can run as a pipe stage thread
+  void (*stage)(char **args, FILE *out);
+  //loaded with enable -f, see myshell_builtin.h
+  myshell_builtin_fn plugin;
+  //library the plugin came from
+  char *library;
+  //next builtin in the same bucket
+  struct builtin *next;
+};
+//table of builtins
+struct builtin *builtins[BUILTIN_BUCKETS];
+
+//one command in a pipeline
+struct stage{
+  char **args;
+  //fds to read from and write to
+  int in;
+  int out;
+  //CPUs to pin to (empty = any)
+  cpu_set_t cpus;
+  //TRUE if run as a thread in the shell, otherwise pid is its process
+  int threaded;
+  pthread_t thread;
+  pid_t pid;
+  //wait status
+  int status;
+};
+
+//pipestat relay between two pipe stages
+struct relay{
+  //read end of the upstream pipe, write end of the downstream pipe
+  int in;
+  int out;
+  pthread_t thread;
+  //bytes moved, and nanoseconds spent waiting on each side
+  //(updated by the relay, read by the live display)
+  uint64_t bytes;
+  uint64_t read_wait;
+  uint64_t write_wait;
+};
+
+//inotify watches for the watch command
+struct watch_list{
+  int fd;
+  //watch descriptors and the path each one is for
+  int count;
+  int size;
+  int *wds;
+  char **paths;
+};
+
+//an alias, its first word is replaced by words
+struct alias{
+  char *name;
+  char **words;
+  int nwords;
+  struct alias *next;
+};
+//table of aliases
+struct alias *aliases[FUNC_BUCKETS];
+
+//a shell function, kept as pre-parsed commands
+struct func{
+  char *name;
+  //each command is a NULL terminated args array
+  char ***cmds;
+  int ncmds;
+  struct func *next;
+};
+//table of functions
+struct func *funcs[FUNC_BUCKETS];
+//how many functions deep the shell is
+int func_depth;
+
+//header at the start of the startup snapshot file. It is followed by
+//the PATH directory mtimes (int64_t), the entries sorted by name, the
+//hash table buckets (entry index + 1, 0 = empty) and the strings
+struct snap_header{
+  char magic[8];
+  uint32_t version;
+  //number of PATH directories
+  uint32_t ndirs;
+  //hash of $PATH when the snapshot was built
+  uint64_t path_hash;
+  //hash of everything after the header
+  uint64_t checksum;
+  uint32_t nentries;
+  //power of 2
+  uint32_t nbuckets;
+  //size of the whole file
+  uint64_t size;
+};
+
+//a command found on PATH, as offsets into the snapshot's strings
+struct snap_entry{
+  uint32_t name;
+  uint32_t path;
+};
+
+//the snapshot, mapped read only at startup (base is NULL if there is none)
+struct snapshot{
+  char *base;
+  size_t size;
+  struct snap_header *header;
+  struct snap_entry *entries;
+  uint32_t *buckets;
+  char *strings;
+};
+struct snapshot snap;
+
+//header at the start of every cache entry, followed by the saved output
+struct cache_header{
+  char magic[8];
+  //wait status of the command
+  int status;
+};
+
 /*-----------------
 Input Processing
 -------------------*/
@@ -109,43 +373,251 @@ void parse_input(char *input, char *args[MAX_ARGS]){
 
 //processes the input and execute the desired commands
 void process_input(char *args[MAX_ARGS]){
-  //change directory command
-  if (!strcmp(args[0], "cd") || !strcmp(args[0], "chdir")) {
-    change_dir(args[1]);
+  //expand an alias in the first word
+  char *expanded[MAX_ARGS];
+  struct alias *a = find_alias(args[0]);
+  if (a != NULL){
+    int n = 0;
+    for (int i = 0; i < a->nwords && n < MAX_ARGS-1; i++)
+      expanded[n++] = a->words[i];
+    for (int i = 1; args[i] != NULL && n < MAX_ARGS-1; i++)
+      expanded[n++] = args[i];
+    expanded[n] = NULL;
+    args = expanded;
+  }
+  //shell function, runs in this process
+  struct func *f = find_func(args[0]);
+  if (f != NULL) {
+    run_function(f, args);
+    return;
+  }
+
+  //look the command up in the builtin table
+  struct builtin *b = find_builtin(args[0]);
+  //loaded builtin, runs in the shell with the standard fds
+  //it overrides a builtin with the same name
+  if (b != NULL && b->plugin != NULL) {
+    run_plugin(b, args, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+  }
+  //builtin command
+  else if (b != NULL) {
+    b->native(args);
+  }
+  //else run external program
+  else {
+    external_prog(args);
+  }
+}
+
+/*-----------------
+Builtin Registry
+-------------------*/
+
+//adapters for builtins that don't take the args array
+static void cd_builtin(char **args){ change_dir(args[1]); }
+static void clear_builtin(char **args){ clear(); }
+static void echo_builtin(char **args){ echo(args, stdout); }
+static void exit_builtin(char **args){ escape(); }
+static void help_builtin(char **args){ help(stdout); }
+static void ls_builtin(char **args){ list_dir(args, stdout); }
+static void pause_builtin(char **args){ pause_cmd(); }
+static void environ_builtin(char **args){ environ_cmd(stdout); }
+static void help_stage(char **args, FILE *out){ help(out); }
+static void environ_stage(char **args, FILE *out){ environ_cmd(out); }
+
+//every builtin that is part of the shell
+static struct {
+  char *name;
+  void (*native)(char **args);
+  void (*stage)(char **args, FILE *out);
+} native_builtins[] = {
+  {"cd", cd_builtin, NULL},
+  {"chdir", cd_builtin, NULL},
+  {"clear", clear_builtin, NULL},
+  {"clr", clear_builtin, NULL},
+  {"echo", echo_builtin, echo},
+  {"exit", exit_builtin, NULL},
+  {"quit", exit_builtin, NULL},
+  {"help", help_builtin, help_stage},
+  {"ls", ls_builtin, list_dir},
+  {"dir", ls_builtin, list_dir},
+  {"pause", pause_builtin, NULL},
+  {"environ", environ_builtin, environ_stage},
+  {"timeout", timeout_cmd, NULL},
+  {"sched", sched_cmd, NULL},
+  {"cache", cache_cmd, NULL},
+  {"enable", enable_cmd, NULL},
+  {"watch", watch_cmd, NULL},
+  {"alias", alias_cmd, NULL},
+  {"unalias", unalias_cmd, NULL},
+  {"functions", functions_cmd, NULL},
+  {"pipestat", pipestat_cmd, NULL},
+};
+
+//gets the bucket a builtin name belongs in
+static struct builtin **builtin_bucket(char *name){
+  return &builtins[hash_string(FNV_OFFSET, name) & (BUILTIN_BUCKETS - 1)];
+}
+
+//fills the builtin table, call once at startup
+void init_builtins(){
+  int count = sizeof(native_builtins) / sizeof(native_builtins[0]);
+  for (int i = 0; i < count; i++){
+    struct builtin *b = add_builtin(native_builtins[i].name);
+    b->native = native_builtins[i].native;
+    b->stage = native_builtins[i].stage;
   }
+}
+
+//finds a builtin by name, returns NULL if there is none
+struct builtin *find_builtin(char *name){
+  struct builtin *b = *builtin_bucket(name);
+  while (b != NULL && strcmp(b->name, name))
+    b = b->next;
+  return b;
+}
+
+//gets the table entry for name, adding an empty one if needed
+struct builtin *add_builtin(char *name){
+  struct builtin *b = find_builtin(name);
+  if (b != NULL)
+    return b;
+  //add to the front of its bucket
+  struct builtin **bucket = builtin_bucket(name);
+  b = calloc(1, sizeof(struct builtin));
+  b->name = strdup(name);
+  b->next = *bucket;
+  *bucket = b;
+  return b;
+}
+
+//runs a loaded builtin in the shell process with the given fds
+void run_plugin(struct builtin *b, char **args, int in, int out, int err){
+  //count the args
+  int argc = 0;
+  while (args[argc] != NULL)
+    argc++;
+  //anything the shell buffered has to come out first
+  fflush(stdout);
+  int ret = b->plugin(argc, args, in, out, err);
+  //save it like a normal exit status
+  status = (ret & 0xff) << 8;
+}
+
+//checks if name is a loaded builtin
+int is_plugin(char *name){
+  struct builtin *b = find_builtin(name);
+  return !is_defined(name) && b != NULL && b->plugin != NULL;
+}
 
-  //clear command
-  else if (!strcmp(args[0], "clear") || !strcmp(args[0], "clr")) {
-    clear();
+//runs a loaded builtin with I/O redirection, without forking
+//opens the files like redirect(), but passes them to the builtin as fds
+void plugin_redirect(char **args){
+  int in = STDIN_FILENO;
+  int out = STDOUT_FILENO;
+  //if input redirection
+  if (input_redir == TRUE){
+    in = open(input_file, O_RDONLY);
+    if (in < 0){
+      puts("Error: Input file not found");
+      return;
+    }
   }
-  //echo command
-  else if (!strcmp(args[0], "echo")) {
-    echo(args);
+  //if output redirection, or appending output redirection
+  if (output_redir == TRUE || append_redir == TRUE){
+    int flags = O_WRONLY|O_CREAT|((output_redir == TRUE) ? 0 : O_APPEND);
+    out = open(output_file, flags, 0666);
+    if (out < 0){
+      puts("Error: Output file not found");
+      if (in != STDIN_FILENO)
+        close(in);
+      return;
+    }
   }
-  //exit command
-  else if (!strcmp(args[0], "exit") || !strcmp(args[0], "quit") ) {
-    escape();
+  //run it
+  run_plugin(find_builtin(args[0]), args, in, out, STDERR_FILENO);
+  //cleanup
+  if (in != STDIN_FILENO)
+    close(in);
+  if (out != STDOUT_FILENO)
+    close(out);
+}
+
+//lists builtins, or loads them from a shared library
+//enable -f lib.so name..., enable -d name
+void enable_cmd(char **args){
+  //no args, list every builtin
+  if (args[1] == NULL){
+    for (int i = 0; i < BUILTIN_BUCKETS; i++){
+      for (struct builtin *b = builtins[i]; b != NULL; b = b->next){
+        if (b->plugin != NULL)
+          printf("enable -f %s %s\n", b->library, b->name);
+        else
+          printf("enable %s\n", b->name);
+      }
+    }
+    return;
   }
-  //help
-  else if (!strcmp(args[0], "help")) {
-    help();
+
+  //remove a loaded builtin
+  if (!strcmp(args[1], "-d")){
+    for (int i = 2; args[i] != NULL; i++){
+      if (!is_plugin(args[i])){
+        printf("Error: %s is not a loaded builtin\n", args[i]);
+        continue;
+      }
+      //an overridden builtin comes back
+      struct builtin *b = find_builtin(args[i]);
+      if (b->native != NULL){
+        b->plugin = NULL;
+        free(b->library);
+        b->library = NULL;
+        continue;
+      }
+      //unlink it from its bucket
+      struct builtin **temp = builtin_bucket(args[i]);
+      while (strcmp((*temp)->name, args[i]))
+        temp = &(*temp)->next;
+      *temp = b->next;
+      //the library stays loaded, other builtins may still use it
+      free(b->name);
+      free(b->library);
+      free(b);
+    }
+    return;
   }
-  //list command
-  else if (!strcmp(args[0], "ls") || !strcmp(args[0], "dir")) {
-    list_dir(args);
+
+  //load from a library
+  if (strcmp(args[1], "-f") || args[2] == NULL || args[3] == NULL){
+    puts("Error: usage: enable -f lib.so name...");
     return;
   }
-  //pause 
-  else if (!strcmp(args[0], "pause")) {
-    pause_cmd();
+  void *lib = dlopen(args[2], RTLD_NOW|RTLD_LOCAL);
+  if (lib == NULL){
+    printf("Error: %s\n", dlerror());
+    return;
   }
-  //environ
-  else if (!strcmp(args[0], "environ")) {
-    environ();
+  //make sure the library was built for this shell
+  int *abi = dlsym(lib, "myshell_builtin_abi");
+  if (abi == NULL || *abi != MYSHELL_BUILTIN_ABI){
+    printf("Error: %s does not use builtin ABI %d\n", args[2], MYSHELL_BUILTIN_ABI);
+    dlclose(lib);
+    return;
   }
-  //else run external program
-  else {
-    external_prog(args);
+  //add each builtin
+  char symbol[BUFF];
+  for (int i = 3; args[i] != NULL; i++){
+    snprintf(symbol, sizeof(symbol), "myshell_%s", args[i]);
+    myshell_builtin_fn fn = (myshell_builtin_fn)dlsym(lib, symbol);
+    if (fn == NULL){
+      printf("Error: %s not found in %s\n", symbol, args[2]);
+      continue;
+    }
+    //overrides any builtin with the same name, which is kept for enable -d
+    struct builtin *b = add_builtin(args[i]);
+    free(b->library);
+    b->plugin = fn;
+    b->library = strdup(args[2]);
   }
 }
 
@@ -251,8 +723,8 @@ void redirect(char **args){
     //execute args
 
   }
-  //run commands
-  external_prog(args);
+  //run commands, builtins included
+  process_input(args);
 }
 
 /*-----------------
@@ -286,68 +758,401 @@ Piping
 void check_pipes(char *args[MAX_ARGS]){
   //reset piped value
   piped = FALSE;
-  args2 = args;
 
   //loop until pipe command "|" or end of args found
-  while (*args2 != NULL){
+  for (int i = 0; args[i] != NULL; i++){
     //if pipe command found
-    if (strcmp(*args2, "|") == 0){
-      //set piped to true
+    if (strcmp(args[i], "|") == 0){
+      //set piped to true, piping() splits the stages up
       piped = TRUE;
-      //set "|" to null, seperates args and args2
-      *args2 = NULL;
-      //move args2 to next argument
-      args2++;
-      //exit function
       return;
     }
-    //next arg
-    args2++;
-  }  
+  }
+}
+
+//checks if a pipe stage can run as a thread in the shell
+//only builtins that just write output (and loaded builtins) can
+static int stage_threadable(char **args){
+  struct builtin *b = find_builtin(args[0]);
+  return !is_defined(args[0]) && b != NULL && (b->stage != NULL || b->plugin != NULL);
+}
+
+//runs a builtin pipe stage inside the shell
+static void *stage_thread(void *arg){
+  struct stage *st = arg;
+  //a closed reader should fail the write, not kill the whole shell with SIGPIPE
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  //only pins this thread
+  pin_cpus(&st->cpus);
+
+  struct builtin *b = find_builtin(st->args[0]);
+  //loaded builtins use the fds directly
+  if (b->plugin != NULL){
+    int argc = 0;
+    while (st->args[argc] != NULL)
+      argc++;
+    st->status = (b->plugin(argc, st->args, st->in, st->out, STDERR_FILENO) & 0xff) << 8;
+    if (st->out != STDOUT_FILENO)
+      close(st->out);
+  }
+  //native builtins write to a FILE
+  else{
+    FILE *out = (st->out == STDOUT_FILENO) ? stdout : fdopen(st->out, "w");
+    if (out != NULL){
+      b->stage(st->args, out);
+      //closing the write end tells the next stage it is done
+      if (out == stdout)
+        fflush(stdout);
+      else
+        fclose(out);
+    }
+    else{
+      close(st->out);
+    }
+    st->status = 0;
+  }
+  //done reading
+  if (st->in != STDIN_FILENO)
+    close(st->in);
+  return NULL;
+}
+
+//forks a process for a pipe stage
+void start_stage(struct stage *st, int pfds[][2], int npipes){
+  st->threaded = FALSE;
+  st->pid = fork();
+  //if fork failed
+  if (st->pid < 0){
+    puts("Error: Fork failed");
+    st->status = 0;
+    return;
+  }
+  //parent is done
+  if (st->pid > 0)
+    return;
+
+  //child, hook up to the pipes
+  if (st->in != STDIN_FILENO)
+    dup2(st->in, STDIN_FILENO);
+  if (st->out != STDOUT_FILENO)
+    dup2(st->out, STDOUT_FILENO);
+  //close every pipe end, otherwise readers never see the end of their input
+  for (int i = 0; i < npipes; i++){
+    close(pfds[i][0]);
+    close(pfds[i][1]);
+  }
+  pin_cpus(&st->cpus);
+  //external commands are exec'd straight away, unless a timeout needs a waiting parent
+  if (find_builtin(st->args[0]) == NULL && !is_defined(st->args[0]) && default_timeout <= 0){
+    exec_prog(st->args);
+  }
+  //execute command
+  process_input(st->args);
+  //only flush stdout, other streams (like a script being read) belong to the shell
+  fflush(stdout);
+  _exit(0);
+}
+
+//nanoseconds on the monotonic clock
+static uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//moves data from one stage to the next with splice(), counting bytes
+//and how long it waits on each side
+static void *relay_thread(void *arg){
+  struct relay *r = arg;
+  //a closed reader should fail the splice, not kill the whole shell with SIGPIPE
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  while (TRUE){
+    //move pages between the pipes without copying
+    ssize_t n = splice(r->in, NULL, r->out, NULL, RELAY_CHUNK, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (n > 0){
+      __atomic_fetch_add(&r->bytes, n, __ATOMIC_RELAXED);
+      continue;
+    }
+    //upstream is done
+    if (n == 0)
+      break;
+    if (errno == EINTR)
+      continue;
+    //downstream is gone, or a real error
+    if (errno != EAGAIN)
+      break;
+
+    //find out which side is holding things up
+    struct pollfd fds[2] = {{r->in, POLLIN, 0}, {r->out, POLLOUT, 0}};
+    poll(fds, 2, 0);
+    if (fds[1].revents & POLLERR)
+      break;
+    //nothing to read means waiting on upstream, otherwise downstream is full
+    int side = (fds[0].revents & (POLLIN|POLLHUP)) ? 1 : 0;
+    uint64_t start = now_ns();
+    poll(&fds[side], 1, -1);
+    __atomic_fetch_add(side ? &r->write_wait : &r->read_wait, now_ns() - start, __ATOMIC_RELAXED);
+  }
+  //pass the end of the data on
+  close(r->in);
+  close(r->out);
+  return NULL;
+}
+
+//for the pipestat live display
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t live_cond = PTHREAD_COND_INITIALIZER;
+static int live_done;
+
+//what the live display needs to know
+struct live_args{
+  struct relay *relays;
+  int nrelays;
+  struct stage *stages;
+  uint64_t start;
+};
+
+//redraws the pipestat numbers on stderr once a second until the pipeline ends
+static void *live_thread(void *arg){
+  struct live_args *live = arg;
+  pthread_mutex_lock(&live_lock);
+  while (!live_done){
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec++;
+    pthread_cond_timedwait(&live_cond, &live_lock, &wake);
+    if (!live_done)
+      pipestat_report(live->relays, live->nrelays, live->stages, (now_ns() - live->start) / 1e9, TRUE);
+  }
+  pthread_mutex_unlock(&live_lock);
+  return NULL;
+}
+
+//prints each relay's throughput and where it spent its time waiting
+//live prints one line that is redrawn in place
+void pipestat_report(struct relay *relays, int nrelays, struct stage *stages, double seconds, int live){
+  if (seconds <= 0)
+    seconds = 1e-9;
+  if (live){
+    fprintf(stderr, "\r\033[K%.1fs", seconds);
+  }
+  else{
+    fprintf(stderr, "pipestat: %.3f s\n", seconds);
+  }
+  for (int i = 0; i < nrelays; i++){
+    double bytes = __atomic_load_n(&relays[i].bytes, __ATOMIC_RELAXED);
+    double starved = __atomic_load_n(&relays[i].read_wait, __ATOMIC_RELAXED) / 1e9;
+    double blocked = __atomic_load_n(&relays[i].write_wait, __ATOMIC_RELAXED) / 1e9;
+    if (live){
+      fprintf(stderr, "  %s->%s %.1f MB/s", stages[i].args[0], stages[i+1].args[0], bytes / seconds / 1e6);
+      continue;
+    }
+    //waiting on upstream means it is the slow side, waiting on downstream is backpressure
+    fprintf(stderr, "  %d %s -> %d %s: %.0f bytes, %.1f MB/s, waiting for input %.3f s (%.0f%%), backpressure %.3f s (%.0f%%)\n",
+            i+1, stages[i].args[0], i+2, stages[i+1].args[0], bytes, bytes / seconds / 1e6,
+            starved, 100 * starved / seconds, blocked, 100 * blocked / seconds);
+  }
+  fflush(stderr);
 }
 
+//pipestat without a pipe has nothing to measure, just run the command
+void pipestat_cmd(char **args){
+  args++;
+  if (*args != NULL && !strcmp(*args, "-l"))
+    args++;
+  if (*args == NULL){
+    puts("Error: usage: pipestat [-l] cmd | cmd...");
+    return;
+  }
+  process_input(args);
+}
 
+//runs every stage of a pipeline and waits for them to finish.
+//builtins that only write output run as threads in the shell,
+//everything else gets its own process.
+//with a "pipestat [-l]" prefix, a relay thread sits between each pair of stages
 void piping(char **args){
-  //pipe file descriptors
-  int pfds[2];
+  struct stage stages[MAX_ARGS];
+  struct relay relays[MAX_ARGS];
+  //with pipestat, each stage pair has a pipe on each side of the relay
+  int pfds[2 * MAX_ARGS][2];
+  int n = 0;
 
-  //create pipe
-  if ( pipe(pfds) == 0 ) {
-    //fork 
+  //a background pipeline runs in its own process, so the shell doesn't wait for it
+  if (background == TRUE){
+    fflush(stdout);
     pid_t pid = fork();
-    //if fork failed
     if (pid < 0){
-      puts("Error: Fork failed");
-      exit(1);
+      puts("Error: fork failed");
+      return;
+    }
+    if (pid == 0){
+      background = FALSE;
+      piping(args);
+      fflush(stdout);
+      _exit(0);
+    }
+    //the child places its stages from the current position, later pipelines go elsewhere
+    if (sched_auto == TRUE){
+      int stages = 1;
+      for (int i = 0; args[i] != NULL; i++){
+        if (!strcmp(args[i], "|"))
+          stages++;
+      }
+      pipe_cpu_next += 2 * ((stages + 1) / 2);
     }
-    //else if child
-    else if ( pid == 0 ) {
+    return;
+  }
 
-      // close stdout
-      close(1);
-      //use pipe's write end as stdout
-      dup2( pfds[1], 1 );
-      //close read end of pipe
-      close( pfds[0] );
-      //execute command
-      process_input(args);
-      //kill child
-      exit(0);
+  //pipestat prefix
+  int metered = FALSE, live = FALSE;
+  if (!strcmp(args[0], "pipestat")){
+    metered = TRUE;
+    args++;
+    if (args[0] != NULL && !strcmp(args[0], "-l")){
+      live = TRUE;
+      args++;
     }
-    //else parent
-    else {
-      //close stdin
-      close(0);
-      //use pipe's read end as stdin
-      dup2( pfds[0], 0 );
-      //close write end of pipe
-      close( pfds[1] );
-      //execute  command
-      process_input(args2);
-      //kill parent
-      exit(0);
+    if (args[0] == NULL){
+      puts("Error: missing command in pipe");
+      return;
+    }
+  }
+
+  //split args into stages at each "|"
+  stages[n++].args = args;
+  for (int i = 0; args[i] != NULL; i++){
+    if (!strcmp(args[i], "|")){
+      args[i] = NULL;
+      stages[n++].args = &args[i+1];
+    }
+  }
+  //every stage needs a command
+  for (int i = 0; i < n; i++){
+    if (stages[i].args[0] == NULL){
+      puts("Error: missing command in pipe");
+      return;
+    }
+  }
+
+  //create the pipes between stages, close-on-exec so commands only keep their own ends
+  int npipes = metered ? 2 * (n-1) : n-1;
+  for (int i = 0; i < npipes; i++){
+    if (pipe2(pfds[i], O_CLOEXEC) < 0){
+      puts("Error: pipe failed");
+      //cleanup
+      while (--i >= 0){
+        close(pfds[i][0]);
+        close(pfds[i][1]);
+      }
+      return;
+    }
+  }
+
+  for (int i = 0; i < n; i++){
+    //stage i writes to pipe i (or 2i for pipestat), and stage i+1 reads from it (or from 2i+1)
+    stages[i].in = (i == 0) ? STDIN_FILENO : pfds[metered ? 2*(i-1)+1 : i-1][0];
+    stages[i].out = (i == n-1) ? STDOUT_FILENO : pfds[metered ? 2*i : i][1];
+    CPU_ZERO(&stages[i].cpus);
+    stages[i].threaded = stage_threadable(stages[i].args);
+  }
+  //CPUs for adjacent stages when automatic placement is on
+  if (sched_auto == TRUE){
+    pick_pipe_cpus(stages, n);
+  }
+  for (int i = 0; metered && i < n-1; i++){
+    memset(&relays[i], 0, sizeof(struct relay));
+    relays[i].in = pfds[2*i][0];
+    relays[i].out = pfds[2*i+1][1];
+    //bigger pipes let each splice() move more, so the relay wakes up less
+    fcntl(relays[i].in, F_SETPIPE_SZ, RELAY_CHUNK);
+    fcntl(relays[i].out, F_SETPIPE_SZ, RELAY_CHUNK);
+  }
+  //write anything buffered before forking
+  fflush(stdout);
+  uint64_t start = now_ns();
+
+  //start the relays before any stage uses their pipes
+  int nrelays = 0;
+  for (int i = 0; metered && i < n-1; i++){
+    if (pthread_create(&relays[i].thread, NULL, relay_thread, &relays[i]) != 0)
+      break;
+    nrelays++;
+  }
+  //no thread for a relay, the stages after it read straight from the stage before
+  if (metered && nrelays < n-1){
+    fprintf(stderr, "pipestat: could not start relay %d, later stages are not measured\n", nrelays + 1);
+    for (int i = nrelays; i < n-1; i++)
+      stages[i+1].in = pfds[2*i][0];
+  }
+
+  //start processes next, the stages' fds are close-on-exec and closed in each child
+  for (int i = 0; i < n; i++){
+    if (!stages[i].threaded)
+      start_stage(&stages[i], pfds, npipes);
+  }
+  //then start builtin stages as threads
+  for (int i = 0; i < n; i++){
+    if (stages[i].threaded && pthread_create(&stages[i].thread, NULL, stage_thread, &stages[i]) != 0){
+      //no thread, fall back to a process
+      start_stage(&stages[i], pfds, npipes);
+    }
+  }
+  //close the pipe ends that are not owned by a thread
+  for (int i = 0; i < npipes; i++){
+    for (int end = 0; end < 2; end++){
+      int owned = FALSE;
+      for (int j = 0; j < n; j++){
+        if (stages[j].threaded && (stages[j].in == pfds[i][end] || stages[j].out == pfds[i][end]))
+          owned = TRUE;
+      }
+      for (int j = 0; j < nrelays; j++){
+        if (relays[j].in == pfds[i][end] || relays[j].out == pfds[i][end])
+          owned = TRUE;
+      }
+      if (!owned)
+        close(pfds[i][end]);
     }
   }
+
+  //live display
+  pthread_t display;
+  struct live_args live_info = {relays, nrelays, stages, start};
+  live_done = FALSE;
+  live = live && pthread_create(&display, NULL, live_thread, &live_info) == 0;
+
+  //wait for every stage
+  for (int i = 0; i < n; i++){
+    if (stages[i].threaded)
+      pthread_join(stages[i].thread, NULL);
+    else if (stages[i].pid > 0)
+      waitpid(stages[i].pid, &stages[i].status, 0);
+  }
+  for (int i = 0; i < nrelays; i++){
+    pthread_join(relays[i].thread, NULL);
+  }
+  //the pipeline's status is the last stage's
+  status = stages[n-1].status;
+
+  //report
+  if (live){
+    pthread_mutex_lock(&live_lock);
+    live_done = TRUE;
+    pthread_cond_signal(&live_cond);
+    pthread_mutex_unlock(&live_lock);
+    pthread_join(display, NULL);
+    fprintf(stderr, "\r\033[K");
+  }
+  if (metered){
+    pipestat_report(relays, nrelays, stages, (now_ns() - start) / 1e9, FALSE);
+  }
 }
 
 /*-----------------------
@@ -372,27 +1177,18 @@ void batch_commands(char **args){
     }
     //if pipe command was detected
     if (piped == TRUE){
-      //fork
-      pid_t pipe_pid = fork();
-      //if fork failed
-      if (pipe_pid < 0){
-        puts("fork failed");
-        exit(0);
-      }
-      //if child
-      else if (pipe_pid == 0){
-        //run piped commands
-        piping(args);
-      } 
-      //else parent
-      else{
-        //wait for child to finish
-        waitpid(pipe_pid, &status, 0);
-      }
+      //run piped commands
+      piping(args);
     }//end if
 
+    //if I/O redirection on a loaded builtin, no fork needed
+    else if ((input_redir == TRUE || output_redir == TRUE || append_redir == TRUE) && is_plugin(args[0])){
+      plugin_redirect(args);
+    }
     //if I/O redirection was found
     else if (input_redir == TRUE || output_redir == TRUE || append_redir == TRUE){
+      //write anything buffered, or it ends up in the output file
+      fflush(stdout);
       //fork
       pid_t io_pid = fork();
       //if fork failed
@@ -422,6 +1218,9 @@ void batch_commands(char **args){
 
 //check if command is a script file ".sh"
 int check_script(char *arg){
+  //too short to end in ".sh", and reading ahead would run past arg
+  if (strlen(arg) < 3)
+    return FALSE;
   //create temp pointer to go through arg
   char *temp = arg;
   //check the third to last letter of arg
@@ -445,10 +1244,17 @@ void run_script(char *arg){
   if (file != NULL){
     //used to hold each line of the file
     char buffer[BUFF];
+    //timeouts set inside the script only last until the script ends
+    long saved_timeout = default_timeout;
     //read next line untill end of file
     while (fgets(buffer, sizeof(buffer), file) != NULL){
       char *dir = get_dir();
       printf("\n<SCRIPT>\n%s%s\n", dir, buffer); 
+      //function definitions are stored, not run
+      if (define_function(buffer, file)){
+        free(dir);
+        continue;
+      }
       //break up line into individual args
       char *args[MAX_ARGS];
       parse_input(buffer, args);
@@ -456,6 +1262,8 @@ void run_script(char *arg){
       //cleanup
       free(dir);
     }
+    //restore the caller's default timeout
+    default_timeout = saved_timeout;
     //close file
     fclose(file);
     return;
@@ -472,10 +1280,12 @@ External Execution
 
 //handles execution of external programs
 void external_prog(char **args){
-  //get the main command
-  char *temp = *args;
-  //move to rest of args
-  int status;
+  //get the time limit for this command
+  long limit = (cmd_timeout >= 0) ? cmd_timeout : default_timeout;
+  //only hand over the terminal if the shell currently owns it
+  int own_tty = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+  //write anything buffered, or the child gets a copy of it
+  fflush(stdout);
   //fork
   pid_t pid = fork();
   //if fork failed
@@ -487,86 +1297,1841 @@ void external_prog(char **args){
 
   //else if child
   else if (pid == 0){
-    //try to run command
-    if (execvp(args[0], args) < 0){
-      //error message if failed
-      puts("Error: Command not recognised");
+    //timed commands get their own process group so the whole group can be killed
+    if (limit > 0 && background != TRUE){
+      setpgid(0, 0);
+      //keep the terminal so the command can still read from it
+      if (own_tty){
+        give_terminal(getpid());
+      }
     }
-
-    //child exits
-    exit(0);
+    //run the command
+    exec_prog(args);
   }
 
   //else parent
   else{
     //if background execution not enabled
     if (background != TRUE){
+      //set the group here too, in case the child has not run yet
+      if (limit > 0){
+        setpgid(pid, pid);
+        if (own_tty){
+          give_terminal(pid);
+        }
+      }
       //wait for child to finish
-      waitpid(pid, &status, 0);
+      if (wait_child(pid, limit, SIGTERM)){
+        printf("Timeout: %s killed after %ldms\n", args[0], limit);
+      }
+      //take the terminal back
+      if (limit > 0 && own_tty){
+        give_terminal(getpgrp());
+      }
     }
     return;
   }
 }
 
-/*-----------------
-Helper Functions
--------------------*/
+//replaces the current process with the command, only call it in a child
+void exec_prog(char **args){
+  //apply any CPU and scheduling settings
+  apply_sched();
+  //use the snapshot's PATH index to skip searching PATH
+  char *path = lookup_command(args[0]);
+  if (path != NULL){
+    execv(path, args);
+  }
+  //try to run command
+  if (execvp(args[0], args) < 0){
+    //error message if failed
+    puts("Error: Command not recognised");
+  }
 
-//Get shell prompt
-char *get_prompt(){
-  //holds string containing directory
-  char cwd[BUFF];
-  //copy current directory into string
-  getcwd(cwd, sizeof(cwd));
-  //get user's login
-  char *login = getpwuid(getuid())->pw_name;
-  //used for formating
-  char *temp1 = malloc(sizeof(char)* 2 * BUFF);
-  char *temp2 = malloc(sizeof(char)*BUFF);
-  //add color to strings
-  sprintf(temp1, GREEN "%s:" RESET , login);
-  sprintf(temp2, BLUE "%s>" RESET, cwd);
-  //combine strings
-  strcat(temp1, temp2);
-  //return string
-  return temp1;
+  //child exits with "not found", without touching the shell's other streams
+  fflush(stdout);
+  _exit(127);
 }
 
-//just get the current directory
-char *get_dir(){
-  //holds string containing directory
-  char *cwd = malloc(sizeof(char)*BUFF);
-  //copy current directory into string
-  getcwd(cwd, sizeof(cwd));
-  //return cwd
-  return cwd;
+//arms a timerfd to go off once after ms milliseconds
+static void arm_timer(int timer, long ms){
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+  timerfd_settime(timer, 0, &spec, NULL);
+}
+
+//waits for a child to finish. If limit (ms) runs out first, the child's
+//process group gets sig, and if that was SIGTERM, SIGKILL after KILL_GRACE.
+//returns TRUE if the child was killed for taking too long
+int wait_child(pid_t pid, long limit, int sig){
+  //no time limit, just wait
+  if (limit <= 0){
+    waitpid(pid, &status, 0);
+    return FALSE;
+  }
+
+  //pidfd becomes readable when the child exits
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  //timerfd becomes readable when the limit is up
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  //if the kernel does not support either one
+  if (pidfd < 0 || timer < 0){
+    puts("Warning: timeout not supported, waiting without a limit");
+    if (pidfd >= 0)
+      close(pidfd);
+    if (timer >= 0)
+      close(timer);
+    waitpid(pid, &status, 0);
+    return FALSE;
+  }
+
+  struct pollfd fds[2] = {{pidfd, POLLIN, 0}, {timer, POLLIN, 0}};
+  int timed_out = FALSE;
+  arm_timer(timer, limit);
+
+  //sleep in poll until the child exits or the timer goes off
+  while (TRUE){
+    if (poll(fds, 2, -1) < 0){
+      //interrupted by a signal, try again
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    //child finished
+    if (fds[0].revents & POLLIN)
+      break;
+    //timer went off
+    if (fds[1].revents & POLLIN){
+      uint64_t ticks;
+      read(timer, &ticks, sizeof(ticks));
+      //signal the whole process group
+      kill(-pid, sig);
+      timed_out = TRUE;
+      //escalate to SIGKILL if SIGTERM is ignored
+      if (sig == SIGTERM){
+        sig = SIGKILL;
+        arm_timer(timer, KILL_GRACE);
+      }
+      //nothing left to send, just wait for the exit
+      else{
+        fds[1].fd = -1;
+      }
+    }
+  }
+
+  //cleanup
+  close(timer);
+  close(pidfd);
+  //reap the child
+  waitpid(pid, &status, 0);
+  return timed_out;
 }
+
+//makes pgid the terminal's foreground process group
+void give_terminal(pid_t pgid){
+  //block SIGTTOU, otherwise a background group gets stopped for trying
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTTOU);
+  sigprocmask(SIG_BLOCK, &set, &old);
+  tcsetpgrp(STDIN_FILENO, pgid);
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
 /*-----------------
-Built-In commands
-(cd, clr, ls, ect.)
+CPU Affinity & Scheduling
 -------------------*/
 
-//change the current directory
-void change_dir(char *newdir){
-  //change current directory to input string
-  if(chdir(newdir)){
-    //if change_dir() failed
-    puts("Error: directory not found");
+//parses a CPU list like "0-3,8,10-11" into set
+//returns the number of CPUs found, or -1 if the list is not valid
+int parse_cpulist(char *list, cpu_set_t *set){
+  CPU_ZERO(set);
+  int count = 0;
+  char *temp = list;
+  while (*temp != '\0' && *temp != '\n'){
+    char *end;
+    //first CPU of the range
+    long low = strtol(temp, &end, 10);
+    if (end == temp || low < 0)
+      return -1;
+    long high = low;
+    temp = end;
+    //if it is a range
+    if (*temp == '-'){
+      temp++;
+      high = strtol(temp, &end, 10);
+      if (end == temp || high < low)
+        return -1;
+      temp = end;
+    }
+    //add every CPU in the range
+    for (long cpu = low; cpu <= high && cpu < CPU_SETSIZE; cpu++){
+      CPU_SET(cpu, set);
+      count++;
+    }
+    //next range
+    if (*temp == ',')
+      temp++;
+    else if (*temp != '\0' && *temp != '\n')
+      return -1;
   }
+  return count;
 }
 
-//list contentents of the directory
-void list_dir(char **args){
-  //get next arg
-  args++;
-  //holds current file's name
-  char *temp;
-  //holds size
-  int size = 2;
-  //holds all elements in dir as a string
-  char *buffer = malloc(sizeof(char)*size);
-  //directory struct
-  DIR *d;
+//reads a CPU list from a sysfs file
+//returns the number of CPUs found, or -1 if the file could not be read
+int read_cpulist(char *path, cpu_set_t *set){
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+  char buffer[BUFF];
+  int count = -1;
+  if (fgets(buffer, sizeof(buffer), file) != NULL)
+    count = parse_cpulist(buffer, set);
+  fclose(file);
+  return count;
+}
+
+//runs a command with CPU, NUMA, nice, io priority or scheduler settings
+//sched [-c cpus] [-N node] [-n nice] [-i class[:level]] [-b] cmd
+//sched auto on|off
+void sched_cmd(char **args){
+  //automatic placement of pipe stages
+  if (args[1] != NULL && !strcmp(args[1], "auto")){
+    if (args[2] != NULL)
+      sched_auto = !strcmp(args[2], "on");
+    printf("automatic pipe placement: %s\n", sched_auto ? "on" : "off");
+    return;
+  }
+
+  //start from no settings
+  struct sched_opts opts = {0};
+  opts.node = -1;
+  opts.active = TRUE;
+  char path[BUFF];
+
+  //read options until the command starts
+  int i = 1;
+  while (args[i] != NULL && args[i][0] == '-'){
+    //every option except -b needs a value
+    if (strcmp(args[i], "-b") && args[i+1] == NULL){
+      puts("Error: missing value for sched option");
+      return;
+    }
+    //CPU list
+    if (!strcmp(args[i], "-c")){
+      if (parse_cpulist(args[++i], &opts.cpus) <= 0){
+        puts("Error: invalid CPU list");
+        return;
+      }
+      opts.has_cpus = TRUE;
+    }
+    //NUMA node, runs on that node's CPUs
+    else if (!strcmp(args[i], "-N")){
+      char *end;
+      long node = strtol(args[++i], &end, 10);
+      opts.node = (end != args[i] && *end == '\0' && node >= 0 && node < MAX_NODES) ? node : -1;
+      sprintf(path, "/sys/devices/system/node/node%d/cpulist", opts.node);
+      if (opts.node < 0 || read_cpulist(path, &opts.cpus) <= 0){
+        puts("Error: NUMA node not found");
+        return;
+      }
+      opts.has_cpus = TRUE;
+    }
+    //nice value
+    else if (!strcmp(args[i], "-n")){
+      char *end;
+      long nice = strtol(args[++i], &end, 10);
+      if (end == args[i] || *end != '\0' || nice < -20 || nice > 19){
+        puts("Error: nice value must be a number from -20 to 19");
+        return;
+      }
+      opts.nice = nice;
+      opts.has_nice = TRUE;
+    }
+    //io priority, "idle", "be:level", "rt:level" or "class:level"
+    else if (!strcmp(args[i], "-i")){
+      char *value = args[++i];
+      if (!strncmp(value, "rt", 2))
+        opts.io_class = 1;
+      else if (!strncmp(value, "be", 2))
+        opts.io_class = 2;
+      else if (!strncmp(value, "idle", 4))
+        opts.io_class = 3;
+      else
+        opts.io_class = atoi(value);
+      //optional level, defaults to the middle
+      char *level = strchr(value, ':');
+      opts.io_level = (level != NULL) ? atoi(level+1) : 4;
+      if (opts.io_class < 1 || opts.io_class > 3 || opts.io_level < 0 || opts.io_level > 7){
+        puts("Error: invalid io priority");
+        return;
+      }
+    }
+    //batch scheduling
+    else if (!strcmp(args[i], "-b")){
+      opts.batch = TRUE;
+    }
+    else{
+      printf("Error: unknown sched option %s\n", args[i]);
+      return;
+    }
+    i++;
+  }
+
+  //if there is no command
+  if (args[i] == NULL){
+    puts("Error: no command given");
+    return;
+  }
+
+  //run the command with these settings
+  struct sched_opts saved = cmd_sched;
+  cmd_sched = opts;
+  process_input(args+i);
+  cmd_sched = saved;
+}
+
+//applies cmd_sched to the current process, only call it in a child before exec
+void apply_sched(){
+  if (cmd_sched.active != TRUE)
+    return;
+  //CPU affinity
+  if (cmd_sched.has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &cmd_sched.cpus) < 0)
+    perror("sched: CPU affinity");
+  //prefer memory from the chosen node
+  if (cmd_sched.node >= 0){
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[cmd_sched.node / (8 * sizeof(unsigned long))] |= 1UL << (cmd_sched.node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NODES) < 0)
+      perror("sched: NUMA memory policy");
+  }
+  //nice value
+  if (cmd_sched.has_nice && setpriority(PRIO_PROCESS, 0, cmd_sched.nice) < 0)
+    perror("sched: nice");
+  //io priority (who = IOPRIO_WHO_PROCESS, class is stored in the top bits)
+  if (cmd_sched.io_class && syscall(SYS_ioprio_set, 1, 0, (cmd_sched.io_class << 13) | cmd_sched.io_level) < 0)
+    perror("sched: io priority");
+  //batch scheduling
+  if (cmd_sched.batch){
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, SCHED_BATCH, &param) < 0)
+      perror("sched: SCHED_BATCH");
+  }
+}
+
+//puts the CPUs the shell may use in an order where hyperthread siblings are next to each other
+//returns how many there are, the order is only worked out once
+static int cpu_order(int **order){
+  static int cpus[CPU_SETSIZE];
+  static int count = -1;
+  *order = cpus;
+  if (count >= 0)
+    return count;
+  count = 0;
+  cpu_set_t allowed, siblings, placed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return count;
+  CPU_ZERO(&placed);
+  char path[BUFF];
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+    if (!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, &placed))
+      continue;
+    cpus[count++] = cpu;
+    CPU_SET(cpu, &placed);
+    //its siblings come straight after it
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    if (read_cpulist(path, &siblings) <= 0)
+      continue;
+    for (int other = 0; other < CPU_SETSIZE; other++){
+      if (CPU_ISSET(other, &siblings) && CPU_ISSET(other, &allowed) && !CPU_ISSET(other, &placed)){
+        cpus[count++] = other;
+        CPU_SET(other, &placed);
+      }
+    }
+  }
+  return count;
+}
+
+//gives each pair of adjacent stages its own pair of CPUs, sharing a core where possible
+//both stages of a pair may run on either CPU, and each pipeline starts where the last one ended
+void pick_pipe_cpus(struct stage *stages, int n){
+  int *order;
+  int count = cpu_order(&order);
+  //nothing to spread over
+  if (count < 2)
+    return;
+  for (int i = 0; i < n; i++){
+    int first = (pipe_cpu_next + 2 * (i / 2)) % count;
+    CPU_SET(order[first], &stages[i].cpus);
+    CPU_SET(order[(first + 1) % count], &stages[i].cpus);
+  }
+  pipe_cpu_next = (pipe_cpu_next + 2 * ((n + 1) / 2)) % count;
+}
+
+//pins the current thread to a set of CPUs, does nothing if the set is empty
+void pin_cpus(cpu_set_t *set){
+  if (CPU_COUNT(set) == 0)
+    return;
+  sched_setaffinity(0, sizeof(cpu_set_t), set);
+}
+
+/*-----------------
+Command Cache
+-------------------*/
+
+//adds len bytes of data to a 64 bit FNV-1a hash
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len){
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++){
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+//adds a string and its terminating '\0' to a hash, so "ab" "c" != "a" "bc"
+uint64_t hash_string(uint64_t hash, char *str){
+  return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+//adds a file's contents (or just its size and mtime if use_mtime) to a hash
+//returns FALSE if the file could not be read
+int hash_file(uint64_t *hash, char *path, int use_mtime){
+  *hash = hash_string(*hash, path);
+  //cheap mode, only look at the file's metadata
+  if (use_mtime){
+    struct stat st;
+    if (stat(path, &st) < 0)
+      return FALSE;
+    *hash = hash_bytes(*hash, &st.st_size, sizeof(st.st_size));
+    *hash = hash_bytes(*hash, &st.st_mtim, sizeof(st.st_mtim));
+    return TRUE;
+  }
+  //hash the whole file
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  int done = hash_fd(hash, fd);
+  close(fd);
+  return done;
+}
+
+//adds the contents of an open file to a hash, from the start
+//uses pread() so the file's offset is left alone
+//returns FALSE if the file could not be read
+int hash_fd(uint64_t *hash, int fd){
+  char buffer[16 * BUFF];
+  ssize_t n;
+  off_t offset = 0;
+  while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0){
+    *hash = hash_bytes(*hash, buffer, n);
+    offset += n;
+  }
+  return n == 0;
+}
+
+//gets the cache directory, creating it if needed
+//uses MYSHELL_CACHE if set, or ~/.cache/myshell otherwise
+char *cache_dir(){
+  static char dir[BUFF];
+  char *env = getenv("MYSHELL_CACHE");
+  if (env != NULL){
+    snprintf(dir, sizeof(dir), "%s", env);
+  }
+  else{
+    char *home = getenv("HOME");
+    if (home == NULL)
+      home = getpwuid(getuid())->pw_dir;
+    //make sure ~/.cache exists first
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+    mkdir(dir, 0755);
+    snprintf(dir, sizeof(dir), "%s/.cache/myshell", home);
+  }
+  mkdir(dir, 0755);
+  return dir;
+}
+
+//copies everything from one file descriptor to another
+void copy_fd(int in, int out){
+  char buffer[16 * BUFF];
+  ssize_t n;
+  while ((n = read(in, buffer, sizeof(buffer))) > 0){
+    //write can be short on pipes
+    char *temp = buffer;
+    while (n > 0){
+      ssize_t done = write(out, temp, n);
+      if (done < 0)
+        return;
+      temp += done;
+      n -= done;
+    }
+  }
+}
+
+//finds the program execvp() would run for name, and copies its path into path
+//returns FALSE if there is none
+static int resolve_command(char *name, char *path, size_t size){
+  //a path already
+  if (strchr(name, '/') != NULL){
+    snprintf(path, size, "%s", name);
+    return access(path, X_OK) == 0;
+  }
+  char *env = getenv("PATH");
+  if (env == NULL)
+    return FALSE;
+  char dirs[BUFF * 4];
+  snprintf(dirs, sizeof(dirs), "%s", env);
+  char *save;
+  for (char *dir = strtok_r(dirs, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)){
+    snprintf(path, size, "%s/%s", dir, name);
+    if (access(path, X_OK) == 0)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+//hashes the code name runs: an alias's words, a function's commands, a loaded
+//builtin's library, or the program PATH leads to, following aliases and functions
+static uint64_t hash_command(uint64_t key, char *name, int depth){
+  if (depth >= FUNC_DEPTH)
+    return key;
+  struct alias *a = find_alias(name);
+  if (a != NULL){
+    key = hash_string(key, "alias");
+    for (int j = 0; j < a->nwords; j++)
+      key = hash_string(key, a->words[j]);
+    //an alias can name a command with the same name
+    if (strcmp(a->words[0], name))
+      return hash_command(key, a->words[0], depth + 1);
+    return key;
+  }
+  struct func *f = find_func(name);
+  if (f != NULL){
+    key = hash_string(key, "function");
+    for (int j = 0; j < f->ncmds; j++){
+      for (char **word = f->cmds[j]; *word != NULL; word++)
+        key = hash_string(key, *word);
+      key = hash_string(key, ";");
+      //and whatever each command runs
+      if (strcmp(f->cmds[j][0], name))
+        key = hash_command(key, f->cmds[j][0], depth + 1);
+    }
+    return key;
+  }
+  struct builtin *b = find_builtin(name);
+  if (b != NULL){
+    //a native builtin is part of the shell
+    if (b->plugin != NULL){
+      key = hash_string(key, b->library);
+      hash_file(&key, b->library, TRUE);
+    }
+    return key;
+  }
+  char program[2 * BUFF];
+  if (resolve_command(name, program, sizeof(program)))
+    hash_file(&key, program, TRUE);
+  return key;
+}
+
+//runs a command through the result cache
+//cache [--env VAR] [--in FILE] [--mtime FILE] [--no-stdin] -- cmd
+//cache --stats, cache --clear
+void cache_cmd(char **args){
+  char *dir = cache_dir();
+  //the key covers the directory, env vars, input files and the command itself
+  uint64_t key = FNV_OFFSET;
+  char path[2 * BUFF];
+  getcwd(path, sizeof(path));
+  key = hash_string(key, path);
+
+  //read options until the command starts
+  int i = 1;
+  int no_stdin = FALSE;
+  while (args[i] != NULL && args[i][0] == '-'){
+    //end of options
+    if (!strcmp(args[i], "--")){
+      i++;
+      break;
+    }
+    //run the command with stdin from /dev/null
+    if (!strcmp(args[i], "--no-stdin")){
+      no_stdin = TRUE;
+      i++;
+      continue;
+    }
+    //show hit and miss counts
+    if (!strcmp(args[i], "--stats")){
+      cache_stats(dir);
+      return;
+    }
+    //empty the cache
+    if (!strcmp(args[i], "--clear")){
+      cache_evict(dir, TRUE);
+      return;
+    }
+    //every other option needs a value
+    if (args[i+1] == NULL){
+      puts("Error: missing value for cache option");
+      return;
+    }
+    //environment variable the command depends on
+    if (!strcmp(args[i], "--env")){
+      char *value = getenv(args[++i]);
+      key = hash_string(key, args[i]);
+      //unset is different from empty
+      int set = (value != NULL);
+      key = hash_bytes(key, &set, sizeof(set));
+      if (set)
+        key = hash_string(key, value);
+    }
+    //input file, by content or by mtime
+    else if (!strcmp(args[i], "--in") || !strcmp(args[i], "--mtime")){
+      int use_mtime = !strcmp(args[i], "--mtime");
+      if (!hash_file(&key, args[++i], use_mtime)){
+        printf("Error: could not read %s\n", args[i]);
+        return;
+      }
+    }
+    else{
+      printf("Error: unknown cache option %s\n", args[i]);
+      return;
+    }
+    i++;
+  }
+
+  //if there is no command
+  if (args[i] == NULL){
+    puts("Error: no command given");
+    return;
+  }
+  //background output can't be captured, just run it
+  if (background == TRUE){
+    process_input(args+i);
+    return;
+  }
+  //stdin is an input too
+  struct stat st;
+  if (!no_stdin && fstat(STDIN_FILENO, &st) == 0){
+    //a pipe could give different input every time, and can't be hashed without using it up
+    if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)){
+      fprintf(stderr, "cache: stdin is a pipe, running without the cache (see --no-stdin)\n");
+      process_input(args+i);
+      return;
+    }
+    //hash what a "<" file holds, not its name
+    if (input_redir == TRUE && S_ISREG(st.st_mode)){
+      key = hash_string(key, "<");
+      if (!hash_fd(&key, STDIN_FILENO)){
+        printf("Error: could not read %s\n", input_file);
+        return;
+      }
+    }
+    //the terminal or the shell's own input, the command gets /dev/null instead
+    else{
+      no_stdin = TRUE;
+    }
+  }
+  if (no_stdin){
+    key = hash_string(key, "--no-stdin");
+  }
+  //PATH, and the code the command runs, so a new or changed program or definition is not replayed
+  char *env = getenv("PATH");
+  key = hash_string(key, env ? env : "");
+  key = hash_command(key, args[i], 0);
+  //the command and its args
+  for (int j = i; args[j] != NULL; j++){
+    key = hash_string(key, args[j]);
+  }
+
+  //entry files are named after the key
+  snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)key);
+  struct cache_header header;
+  //write anything already buffered before the saved output
+  fflush(stdout);
+
+  //if there is a saved result, replay it without running anything
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0){
+    if (read(fd, &header, sizeof(header)) == sizeof(header) && !memcmp(header.magic, CACHE_MAGIC, 8)){
+      copy_fd(fd, STDOUT_FILENO);
+      status = header.status;
+      //mark as recently used for eviction
+      futimens(fd, NULL);
+      close(fd);
+      cache_count(dir, TRUE);
+      return;
+    }
+    //bad entry, run the command again
+    close(fd);
+  }
+  cache_count(dir, FALSE);
+
+  //run the command with its output going to a temp file
+  char temp[2 * BUFF];
+  snprintf(temp, sizeof(temp), "%s/tmp.XXXXXX", dir);
+  int out = mkstemp(temp);
+  if (out < 0){
+    //can't save anything, just run it
+    process_input(args+i);
+    return;
+  }
+  //leave room for the header
+  memset(&header, 0, sizeof(header));
+  write(out, &header, sizeof(header));
+  int saved = dup(STDOUT_FILENO);
+  dup2(out, STDOUT_FILENO);
+  //with --no-stdin, the command reads from /dev/null
+  int saved_in = -1;
+  int null = no_stdin ? open("/dev/null", O_RDONLY) : -1;
+  if (null >= 0){
+    saved_in = dup(STDIN_FILENO);
+    dup2(null, STDIN_FILENO);
+    close(null);
+  }
+  status = 0;
+  process_input(args+i);
+  fflush(stdout);
+  //put stdout and stdin back
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  if (saved_in >= 0){
+    dup2(saved_in, STDIN_FILENO);
+    close(saved_in);
+  }
+
+  //pass the output on
+  lseek(out, sizeof(header), SEEK_SET);
+  copy_fd(out, STDOUT_FILENO);
+
+  //only keep results of commands that exited on their own, and were found
+  if (WIFEXITED(status) && WEXITSTATUS(status) != 127){
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.status = status;
+    pwrite(out, &header, sizeof(header), 0);
+    rename(temp, path);
+  }
+  else{
+    unlink(temp);
+  }
+  close(out);
+  //keep the cache under its size limit
+  cache_evict(dir, FALSE);
+}
+
+//adds a hit or a miss to the counts in the cache's stats file
+void cache_count(char *dir, int hit){
+  char path[2 * BUFF];
+  unsigned long hits = 0, misses = 0;
+  snprintf(path, sizeof(path), "%s/stats", dir);
+  //read the old counts
+  FILE *file = fopen(path, "r");
+  if (file != NULL){
+    if (fscanf(file, "%lu %lu", &hits, &misses) != 2)
+      hits = misses = 0;
+    fclose(file);
+  }
+  if (hit)
+    hits++;
+  else
+    misses++;
+  //write the new counts
+  file = fopen(path, "w");
+  if (file != NULL){
+    fprintf(file, "%lu %lu\n", hits, misses);
+    fclose(file);
+  }
+}
+
+//prints hit and miss counts and how much space the cache uses
+void cache_stats(char *dir){
+  char path[2 * BUFF];
+  unsigned long hits = 0, misses = 0;
+  snprintf(path, sizeof(path), "%s/stats", dir);
+  FILE *file = fopen(path, "r");
+  if (file != NULL){
+    if (fscanf(file, "%lu %lu", &hits, &misses) != 2)
+      hits = misses = 0;
+    fclose(file);
+  }
+
+  //count entries and their size
+  unsigned long entries = 0;
+  long long bytes = 0;
+  DIR *d = opendir(dir);
+  struct dirent *ent;
+  struct stat st;
+  if (d){
+    while ((ent = readdir(d)) != NULL){
+      //entries are named with 16 hex digits
+      if (strlen(ent->d_name) != 16 || fstatat(dirfd(d), ent->d_name, &st, 0) < 0)
+        continue;
+      entries++;
+      bytes += st.st_size;
+    }
+    closedir(d);
+  }
+
+  char *limit = getenv("MYSHELL_CACHE_SIZE");
+  printf("cache: %s\n", dir);
+  printf("hits: %lu  misses: %lu  hit rate: %.1f%%\n", hits, misses,
+         (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
+  printf("entries: %lu  size: %lld bytes  limit: %lld bytes\n", entries, bytes,
+         limit ? atoll(limit) : (long long)CACHE_MAX);
+}
+
+//one cache entry, used for eviction
+struct cache_entry{
+  char name[17];
+  time_t used;
+  off_t size;
+};
+
+//sorts cache entries oldest first
+static int compare_entries(const void *a, const void *b){
+  const struct cache_entry *x = a, *y = b;
+  return (x->used > y->used) - (x->used < y->used);
+}
+
+//removes the least recently used entries until the cache fits in its limit
+//removes every entry if clear is TRUE
+void cache_evict(char *dir, int clear){
+  char *env = getenv("MYSHELL_CACHE_SIZE");
+  long long limit = env ? atoll(env) : CACHE_MAX;
+  if (clear)
+    limit = 0;
+
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+  //collect every entry with its size and last use
+  int count = 0, size = 64;
+  struct cache_entry *list = malloc(sizeof(struct cache_entry) * size);
+  long long total = 0;
+  struct dirent *ent;
+  struct stat st;
+  while ((ent = readdir(d)) != NULL){
+    if (strlen(ent->d_name) != 16 || fstatat(dirfd(d), ent->d_name, &st, 0) < 0)
+      continue;
+    //grow the list if needed
+    if (count == size){
+      size *= 2;
+      list = realloc(list, sizeof(struct cache_entry) * size);
+    }
+    strcpy(list[count].name, ent->d_name);
+    list[count].used = st.st_mtime;
+    list[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+
+  //remove the oldest entries first
+  if (total > limit){
+    qsort(list, count, sizeof(struct cache_entry), compare_entries);
+    for (int i = 0; i < count && total > limit; i++){
+      if (unlinkat(dirfd(d), list[i].name, 0) == 0)
+        total -= list[i].size;
+    }
+  }
+  //cleanup
+  closedir(d);
+  free(list);
+}
+
+/*-----------------
+Watch
+-------------------*/
+
+//adds an inotify watch for path, and every directory under it if recursive
+//returns FALSE if path could not be watched
+int watch_path(struct watch_list *list, char *path, int recursive){
+  int wd = inotify_add_watch(list->fd, path, WATCH_EVENTS);
+  if (wd < 0)
+    return FALSE;
+  //grow the list if needed
+  if (list->count == list->size){
+    list->size = list->size ? list->size * 2 : 16;
+    list->wds = realloc(list->wds, sizeof(int) * list->size);
+    list->paths = realloc(list->paths, sizeof(char *) * list->size);
+  }
+  list->wds[list->count] = wd;
+  list->paths[list->count] = strdup(path);
+  list->count++;
+
+  //add sub directories
+  if (recursive){
+    DIR *d = opendir(path);
+    if (d == NULL)
+      return TRUE;
+    struct dirent *dir;
+    char sub[2 * BUFF];
+    while ((dir = readdir(d)) != NULL){
+      if (dir->d_type != DT_DIR || !strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
+        continue;
+      snprintf(sub, sizeof(sub), "%s/%s", path, dir->d_name);
+      watch_path(list, sub, TRUE);
+    }
+    closedir(d);
+  }
+  return TRUE;
+}
+
+//watches list entry i's path again, after the file was deleted or replaced by a rename
+//the entry's wd is -1 while the path doesn't exist
+void watch_again(struct watch_list *list, int i){
+  //a moved file keeps its old watch, drop it
+  if (list->wds[i] >= 0)
+    inotify_rm_watch(list->fd, list->wds[i]);
+  list->wds[i] = inotify_add_watch(list->fd, list->paths[i], WATCH_EVENTS);
+}
+
+//starts the watched command in its own process group
+//returns its pid, and a pidfd that becomes readable when it exits
+pid_t watch_start(char **args, int *pidfd){
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0){
+    puts("Error: fork failed");
+    *pidfd = -1;
+    return -1;
+  }
+  //child
+  if (pid == 0){
+    //own group, so a rerun can kill everything it started
+    setpgid(0, 0);
+    //the shell blocked SIGINT for the watch, undo that
+    sigset_t set;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    //run it like a line from a script
+    if (check_script(args[0]))
+      run_script(args[0]);
+    else if (find_builtin(args[0]) == NULL && !is_defined(args[0]))
+      exec_prog(args);
+    else
+      process_input(args);
+    fflush(stdout);
+    _exit(0);
+  }
+  //parent
+  setpgid(pid, pid);
+  *pidfd = syscall(SYS_pidfd_open, pid, 0);
+  return pid;
+}
+
+//stops a running watched command and everything it started
+void watch_stop(pid_t pid, int pidfd){
+  kill(-pid, SIGTERM);
+  //SIGKILL if it is still running after the grace period
+  wait_child(pid, KILL_GRACE, SIGKILL);
+  close(pidfd);
+}
+
+//reruns a command every time the watched files change
+//watch [-r] [-d ms] --paths path... -- cmd
+void watch_cmd(char **args){
+  int recursive = FALSE;
+  long debounce = WATCH_DEBOUNCE;
+  struct watch_list list = {0};
+  list.fd = inotify_init1(IN_CLOEXEC|IN_NONBLOCK);
+  if (list.fd < 0){
+    puts("Error: inotify not available");
+    return;
+  }
+
+  //read options until the command starts
+  int i = 1;
+  int paths = FALSE;
+  int bad = FALSE;
+  while (args[i] != NULL && strcmp(args[i], "--")){
+    if (!strcmp(args[i], "-r")){
+      recursive = TRUE;
+      paths = FALSE;
+    }
+    else if (!strcmp(args[i], "-d") && args[i+1] != NULL){
+      debounce = parse_duration(args[++i]);
+      paths = FALSE;
+    }
+    else if (!strcmp(args[i], "--paths")){
+      paths = TRUE;
+    }
+    //a path to watch
+    else if (paths){
+      if (!watch_path(&list, args[i], recursive))
+        printf("Error: could not watch %s\n", args[i]);
+    }
+    else{
+      printf("Error: unknown watch option %s\n", args[i]);
+      bad = TRUE;
+      break;
+    }
+    i++;
+  }
+  //need a command and something to watch
+  if (bad || debounce < 0 || args[i] == NULL || args[i+1] == NULL || list.count == 0){
+    if (!bad)
+      puts("Error: usage: watch [-r] [-d time] --paths path... -- cmd");
+    //cleanup
+    for (int j = 0; j < list.count; j++)
+      free(list.paths[j]);
+    free(list.paths);
+    free(list.wds);
+    close(list.fd);
+    return;
+  }
+  char **cmd = args + i + 1;
+
+  //take SIGINT through a signalfd, so ctrl-c ends the watch instead of the shell
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigprocmask(SIG_BLOCK, &set, &old);
+  int sigfd = signalfd(-1, &set, SFD_CLOEXEC);
+  //timer for the quiet time after the last change
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+  //files that changed since the last run
+  char *changed[WATCH_REPORT];
+  int nchanged = 0;
+  int extra = 0;
+
+  //first run
+  int pidfd;
+  pid_t pid = watch_start(cmd, &pidfd);
+  printf("watch: %d paths, ctrl-c to stop\n", list.count);
+
+  //sleep in poll until a file changes, the timer goes off, the command exits or ctrl-c
+  struct pollfd fds[4] = {{list.fd, POLLIN, 0}, {timer, POLLIN, 0}, {sigfd, POLLIN, 0}, {pidfd, POLLIN, 0}};
+  while (TRUE){
+    fds[3].fd = (pid > 0) ? pidfd : -1;
+    if (poll(fds, 4, -1) < 0){
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    //ctrl-c
+    if (fds[2].revents & POLLIN)
+      break;
+
+    //command finished on its own
+    if (fds[3].revents & POLLIN){
+      waitpid(pid, &status, 0);
+      close(pidfd);
+      pid = -1;
+      printf("watch: done, exit status %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+
+    //files changed
+    if (fds[0].revents & POLLIN){
+      char buffer[16 * BUFF] __attribute__((aligned(__alignof__(struct inotify_event))));
+      ssize_t n;
+      while ((n = read(list.fd, buffer, sizeof(buffer))) > 0){
+        for (char *temp = buffer; temp < buffer + n; temp += sizeof(struct inotify_event) + ((struct inotify_event *)temp)->len){
+          struct inotify_event *event = (struct inotify_event *)temp;
+          //events were lost, so anything may have changed
+          if (event->mask & IN_Q_OVERFLOW){
+            if (nchanged < WATCH_REPORT)
+              changed[nchanged++] = strdup("(events lost)");
+            continue;
+          }
+          //find which path the event is for
+          char *dir = NULL;
+          int index = -1;
+          for (int j = 0; j < list.count; j++){
+            if (list.wds[j] == event->wd){
+              dir = list.paths[j];
+              index = j;
+            }
+          }
+          if (dir == NULL)
+            continue;
+          //the path was deleted or replaced (editors save by renaming over it), watch what is there now
+          if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))
+            watch_again(&list, index);
+          char path[2 * BUFF];
+          if (event->len > 0)
+            snprintf(path, sizeof(path), "%s/%s", dir, event->name);
+          else
+            snprintf(path, sizeof(path), "%s", dir);
+          //watch new directories too
+          if (recursive && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE|IN_MOVED_TO)))
+            watch_path(&list, path, TRUE);
+          //remember it for the report, once
+          int seen = FALSE;
+          for (int j = 0; j < nchanged; j++){
+            if (!strcmp(changed[j], path))
+              seen = TRUE;
+          }
+          if (!seen && nchanged < WATCH_REPORT)
+            changed[nchanged++] = strdup(path);
+          else if (!seen)
+            extra++;
+        }
+      }
+      //wait for things to go quiet before rerunning
+      arm_timer(timer, debounce > 0 ? debounce : 1);
+    }
+
+    //quiet time is over, rerun
+    if (fds[1].revents & POLLIN){
+      uint64_t ticks;
+      read(timer, &ticks, sizeof(ticks));
+      //cancel a run that is still going
+      if (pid > 0){
+        watch_stop(pid, pidfd);
+        puts("watch: cancelled previous run");
+      }
+      //report what changed
+      printf("watch: rerun, changed:");
+      for (int j = 0; j < nchanged; j++){
+        printf(" %s", changed[j]);
+        free(changed[j]);
+      }
+      if (extra > 0)
+        printf(" (and %d more)", extra);
+      puts("");
+      nchanged = 0;
+      extra = 0;
+      //paths that were gone may be back by now
+      for (int j = 0; j < list.count; j++){
+        if (list.wds[j] < 0)
+          watch_again(&list, j);
+      }
+      pid = watch_start(cmd, &pidfd);
+    }
+  }
+
+  //stop the last run
+  if (pid > 0)
+    watch_stop(pid, pidfd);
+  puts("watch: stopped");
+  //cleanup
+  for (int j = 0; j < nchanged; j++)
+    free(changed[j]);
+  for (int j = 0; j < list.count; j++)
+    free(list.paths[j]);
+  free(list.paths);
+  free(list.wds);
+  close(timer);
+  close(sigfd);
+  close(list.fd);
+  //drop the pending ctrl-c, then let SIGINT through again
+  struct timespec zero = {0};
+  sigtimedwait(&set, NULL, &zero);
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/*-----------------
+Startup Snapshot
+-------------------*/
+
+//gets the snapshot's file name, MYSHELL_SNAPSHOT or "snapshot" in the cache directory
+char *snapshot_path(){
+  static char path[2 * BUFF];
+  char *env = getenv("MYSHELL_SNAPSHOT");
+  if (env != NULL)
+    snprintf(path, sizeof(path), "%s", env);
+  else
+    snprintf(path, sizeof(path), "%s/snapshot", cache_dir());
+  return path;
+}
+
+//gets a directory's mtime in nanoseconds, 0 if it doesn't exist
+static int64_t dir_mtime(char *dir){
+  struct stat st;
+  if (stat(dir, &st) < 0)
+    return 0;
+  return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+//hashes a snapshot, with its header but not the checksum itself
+static uint64_t snap_checksum(char *base, size_t size){
+  struct snap_header header;
+  memcpy(&header, base, sizeof(header));
+  header.checksum = 0;
+  uint64_t hash = hash_bytes(FNV_OFFSET, &header, sizeof(header));
+  return hash_bytes(hash, base + sizeof(header), size - sizeof(header));
+}
+
+//maps the snapshot and checks that it is still up to date
+//returns TRUE if snap can be used
+int load_snapshot(){
+  int fd = open(snapshot_path(), O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct snap_header)){
+    close(fd);
+    return FALSE;
+  }
+  char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return FALSE;
+
+  struct snap_header *header = (struct snap_header *)base;
+  int64_t *mtimes = (int64_t *)(base + sizeof(struct snap_header));
+  char *path = getenv("PATH");
+  //right format, size and PATH
+  int valid = !memcmp(header->magic, SNAP_MAGIC, 8) && header->version == SNAP_VERSION
+    && header->size == (uint64_t)st.st_size && path != NULL
+    && header->path_hash == hash_string(FNV_OFFSET, path);
+  //contents, header included, are not damaged
+  valid = valid && header->checksum == snap_checksum(base, st.st_size);
+  //tables fit in the file, in 64 bits so the counts can't wrap
+  uint64_t tables = sizeof(struct snap_header) + 8 * (uint64_t)header->ndirs
+    + 8 * (uint64_t)header->nentries + 4 * (uint64_t)header->nbuckets;
+  valid = valid && tables <= (uint64_t)st.st_size;
+  //a power of 2 buckets, with an empty one so probing stops
+  valid = valid && header->nbuckets != 0 && (header->nbuckets & (header->nbuckets - 1)) == 0
+    && header->nentries < header->nbuckets;
+  struct snap_entry *entries = (struct snap_entry *)(mtimes + (valid ? header->ndirs : 0));
+  uint32_t *buckets = (uint32_t *)(entries + (valid ? header->nentries : 0));
+  char *strings = (char *)(buckets + (valid ? header->nbuckets : 0));
+  uint64_t pool = valid ? st.st_size - tables : 0;
+  //the string pool ends in a '\0', so no string can run off the end
+  //the buckets and offsets were written by build_snapshot() and the checksum covers them
+  valid = valid && (header->nentries == 0 || (pool > 0 && strings[pool - 1] == '\0'));
+
+  //no PATH directory changed since the snapshot was built
+  if (valid){
+    char dirs[BUFF * 4];
+    snprintf(dirs, sizeof(dirs), "%s", path);
+    uint32_t i = 0;
+    for (char *dir = strtok(dirs, ":"); dir != NULL && valid; dir = strtok(NULL, ":"), i++){
+      valid = i < header->ndirs && mtimes[i] == dir_mtime(dir);
+    }
+    valid = valid && i == header->ndirs;
+  }
+  if (!valid){
+    munmap(base, st.st_size);
+    return FALSE;
+  }
+
+  //find the tables
+  snap.base = base;
+  snap.size = st.st_size;
+  snap.header = header;
+  snap.entries = entries;
+  snap.buckets = buckets;
+  snap.strings = strings;
+  return TRUE;
+}
+
+//one command found while building a snapshot
+struct snap_command{
+  char *name;
+  char *path;
+  //position of its directory in PATH
+  int dir;
+};
+
+//sorts commands by name, then by PATH order
+static int compare_commands(const void *a, const void *b){
+  const struct snap_command *x = a, *y = b;
+  int diff = strcmp(x->name, y->name);
+  return diff ? diff : x->dir - y->dir;
+}
+
+//scans PATH and writes a new snapshot to path
+void build_snapshot(char *path){
+  char *env = getenv("PATH");
+  if (env == NULL)
+    return;
+  char dirs[BUFF * 4];
+  snprintf(dirs, sizeof(dirs), "%s", env);
+
+  //collect every executable in every PATH directory
+  int count = 0, size = 256, ndirs = 0;
+  struct snap_command *list = malloc(sizeof(struct snap_command) * size);
+  int64_t mtimes[BUFF];
+  for (char *dir = strtok(dirs, ":"); dir != NULL && ndirs < BUFF; dir = strtok(NULL, ":")){
+    //mtime first, so changes during the scan make the snapshot stale
+    mtimes[ndirs] = dir_mtime(dir);
+    DIR *d = opendir(dir);
+    if (d != NULL){
+      struct dirent *ent;
+      struct stat st;
+      while ((ent = readdir(d)) != NULL){
+        if (ent->d_name[0] == '.' || fstatat(dirfd(d), ent->d_name, &st, 0) < 0)
+          continue;
+        if (!S_ISREG(st.st_mode) || faccessat(dirfd(d), ent->d_name, X_OK, 0) < 0)
+          continue;
+        //grow the list if needed
+        if (count == size){
+          size *= 2;
+          list = realloc(list, sizeof(struct snap_command) * size);
+        }
+        list[count].name = strdup(ent->d_name);
+        list[count].path = malloc(strlen(dir) + strlen(ent->d_name) + 2);
+        sprintf(list[count].path, "%s/%s", dir, ent->d_name);
+        list[count].dir = ndirs;
+        count++;
+      }
+      closedir(d);
+    }
+    ndirs++;
+  }
+
+  //sort by name, and keep only the first directory's copy like execvp does
+  qsort(list, count, sizeof(struct snap_command), compare_commands);
+  int unique = 0;
+  for (int i = 0; i < count; i++){
+    if (unique > 0 && !strcmp(list[unique-1].name, list[i].name)){
+      free(list[i].name);
+      free(list[i].path);
+      continue;
+    }
+    list[unique++] = list[i];
+  }
+
+  //size the hash table at under half full
+  uint32_t nbuckets = 16;
+  while (nbuckets < 2 * (uint32_t)unique)
+    nbuckets *= 2;
+  size_t strings = 0;
+  for (int i = 0; i < unique; i++)
+    strings += strlen(list[i].name) + strlen(list[i].path) + 2;
+
+  //lay out the file in memory
+  size_t total = sizeof(struct snap_header) + sizeof(int64_t) * ndirs + sizeof(struct snap_entry) * unique
+    + sizeof(uint32_t) * nbuckets + strings;
+  char *base = calloc(1, total);
+  struct snap_header *header = (struct snap_header *)base;
+  memcpy(base + sizeof(struct snap_header), mtimes, sizeof(int64_t) * ndirs);
+  struct snap_entry *entries = (struct snap_entry *)(base + sizeof(struct snap_header) + sizeof(int64_t) * ndirs);
+  uint32_t *buckets = (uint32_t *)(entries + unique);
+  char *pool = (char *)(buckets + nbuckets);
+  uint32_t offset = 0;
+  for (int i = 0; i < unique; i++){
+    //strings
+    entries[i].name = offset;
+    strcpy(pool + offset, list[i].name);
+    offset += strlen(list[i].name) + 1;
+    entries[i].path = offset;
+    strcpy(pool + offset, list[i].path);
+    offset += strlen(list[i].path) + 1;
+    //hash table, linear probing
+    uint32_t b = hash_string(FNV_OFFSET, list[i].name) & (nbuckets - 1);
+    while (buckets[b] != 0)
+      b = (b + 1) & (nbuckets - 1);
+    buckets[b] = i + 1;
+    free(list[i].name);
+    free(list[i].path);
+  }
+  free(list);
+
+  //header last, it covers the rest
+  memcpy(header->magic, SNAP_MAGIC, 8);
+  header->version = SNAP_VERSION;
+  header->ndirs = ndirs;
+  header->path_hash = hash_string(FNV_OFFSET, env);
+  header->nentries = unique;
+  header->nbuckets = nbuckets;
+  header->size = total;
+  header->checksum = snap_checksum(base, total);
+
+  //write to a temp file and rename, so readers never see half a snapshot
+  char temp[2 * BUFF + 8];
+  snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+  int fd = mkstemp(temp);
+  if (fd >= 0){
+    if (write(fd, base, total) == (ssize_t)total)
+      rename(temp, path);
+    else
+      unlink(temp);
+    close(fd);
+  }
+  free(base);
+}
+
+//rebuilds the snapshot in a background process, ready for the next start
+void rebuild_snapshot(){
+  char *path = snapshot_path();
+  pid_t pid = fork();
+  if (pid < 0)
+    return;
+  //child forks again and exits, so the shell never has to reap the builder
+  if (pid == 0){
+    if (fork() == 0){
+      //stay out of the way of the interactive shell
+      setpriority(PRIO_PROCESS, 0, 10);
+      //only one shell at a time needs to rebuild it
+      char lock[2 * BUFF + 8];
+      snprintf(lock, sizeof(lock), "%s.lock", path);
+      int fd = open(lock, O_WRONLY|O_CREAT|O_CLOEXEC, 0600);
+      if (fd >= 0 && flock(fd, LOCK_EX|LOCK_NB) == 0)
+        build_snapshot(path);
+    }
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+//finds a command's full path in the snapshot, NULL if not found
+char *lookup_command(char *name){
+  if (snap.base == NULL || strchr(name, '/') != NULL)
+    return NULL;
+  uint32_t mask = snap.header->nbuckets - 1;
+  uint32_t b = hash_string(FNV_OFFSET, name) & mask;
+  //probe until an empty bucket
+  while (snap.buckets[b] != 0){
+    struct snap_entry *entry = &snap.entries[snap.buckets[b] - 1];
+    if (!strcmp(snap.strings + entry->name, name))
+      return snap.strings + entry->path;
+    b = (b + 1) & mask;
+  }
+  return NULL;
+}
+
+//gives readline the builtins and PATH commands that start with text
+static char *command_generator(const char *text, int state){
+  static int bucket;
+  static struct builtin *b;
+  static uint32_t next;
+  size_t len = strlen(text);
+  //first call, start from the beginning
+  if (state == 0){
+    bucket = 0;
+    b = builtins[0];
+    //entries are sorted, so find the first one at or after text
+    uint32_t low = 0, high = snap.base ? snap.header->nentries : 0;
+    while (low < high){
+      uint32_t mid = (low + high) / 2;
+      if (strcmp(snap.strings + snap.entries[mid].name, text) < 0)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    next = low;
+  }
+  //builtins first
+  while (bucket < BUILTIN_BUCKETS){
+    if (b == NULL){
+      if (++bucket < BUILTIN_BUCKETS)
+        b = builtins[bucket];
+      continue;
+    }
+    struct builtin *temp = b;
+    b = b->next;
+    if (!strncmp(temp->name, text, len))
+      return strdup(temp->name);
+  }
+  //then matching PATH commands, which are all next to each other
+  if (snap.base != NULL && next < snap.header->nentries){
+    char *name = snap.strings + snap.entries[next].name;
+    if (!strncmp(name, text, len)){
+      next++;
+      return strdup(name);
+    }
+  }
+  return NULL;
+}
+
+//readline completion, commands for the first word and file names after that
+char **complete_command(const char *text, int start, int end){
+  if (start != 0)
+    return NULL;
+  return rl_completion_matches(text, command_generator);
+}
+
+/*-----------------
+Aliases & Functions
+-------------------*/
+
+//finds an alias by name, returns NULL if there is none
+struct alias *find_alias(char *name){
+  struct alias *a = aliases[hash_string(FNV_OFFSET, name) & (FUNC_BUCKETS - 1)];
+  while (a != NULL && strcmp(a->name, name))
+    a = a->next;
+  return a;
+}
+
+//finds a function by name, returns NULL if there is none
+struct func *find_func(char *name){
+  struct func *f = funcs[hash_string(FNV_OFFSET, name) & (FUNC_BUCKETS - 1)];
+  while (f != NULL && strcmp(f->name, name))
+    f = f->next;
+  return f;
+}
+
+//checks if name is an alias or a function
+int is_defined(char *name){
+  return find_alias(name) != NULL || find_func(name) != NULL;
+}
+
+//lists aliases, shows one, or defines one with "alias name=value..."
+void alias_cmd(char **args){
+  //no args, list every alias
+  if (args[1] == NULL){
+    for (int i = 0; i < FUNC_BUCKETS; i++){
+      for (struct alias *a = aliases[i]; a != NULL; a = a->next){
+        printf("alias %s=", a->name);
+        for (int j = 0; j < a->nwords; j++)
+          printf(j ? " %s" : "%s", a->words[j]);
+        puts("");
+      }
+    }
+    return;
+  }
+
+  char *value = strchr(args[1], '=');
+  //no value, show the alias
+  if (value == NULL){
+    struct alias *a = find_alias(args[1]);
+    if (a == NULL){
+      printf("Error: %s is not an alias\n", args[1]);
+      return;
+    }
+    printf("alias %s=", a->name);
+    for (int j = 0; j < a->nwords; j++)
+      printf(j ? " %s" : "%s", a->words[j]);
+    puts("");
+    return;
+  }
+  //copy the name, args may be a function's stored words
+  char *name = strndup(args[1], value - args[1]);
+  value++;
+
+  //collect the words, dropping quotes around the whole value
+  char *words[MAX_ARGS];
+  int n = 0;
+  char quote = (*value == '\'' || *value == '"') ? *value++ : '\0';
+  if (*value != '\0')
+    words[n++] = value;
+  for (int i = 2; args[i] != NULL && n < MAX_ARGS-1; i++)
+    words[n++] = args[i];
+  if (n == 0){
+    puts("Error: empty alias");
+    free(name);
+    return;
+  }
+
+  //replace an existing alias, or add a new one
+  struct alias *a = find_alias(name);
+  if (a == NULL){
+    struct alias **bucket = &aliases[hash_string(FNV_OFFSET, name) & (FUNC_BUCKETS - 1)];
+    a = calloc(1, sizeof(struct alias));
+    a->name = name;
+    a->next = *bucket;
+    *bucket = a;
+  }
+  else{
+    for (int j = 0; j < a->nwords; j++)
+      free(a->words[j]);
+    free(a->words);
+    free(name);
+  }
+  a->words = malloc(sizeof(char *) * n);
+  a->nwords = n;
+  for (int j = 0; j < n; j++)
+    a->words[j] = strdup(words[j]);
+  //closing quote
+  char *last = a->words[n-1];
+  if (quote != '\0' && *last != '\0' && last[strlen(last)-1] == quote)
+    last[strlen(last)-1] = '\0';
+}
+
+//removes aliases
+void unalias_cmd(char **args){
+  for (int i = 1; args[i] != NULL; i++){
+    struct alias **temp = &aliases[hash_string(FNV_OFFSET, args[i]) & (FUNC_BUCKETS - 1)];
+    while (*temp != NULL && strcmp((*temp)->name, args[i]))
+      temp = &(*temp)->next;
+    if (*temp == NULL){
+      printf("Error: %s is not an alias\n", args[i]);
+      continue;
+    }
+    //unlink and free it
+    struct alias *a = *temp;
+    *temp = a->next;
+    for (int j = 0; j < a->nwords; j++)
+      free(a->words[j]);
+    free(a->words);
+    free(a->name);
+    free(a);
+  }
+}
+
+//lists every function and its commands
+void functions_cmd(char **args){
+  for (int i = 0; i < FUNC_BUCKETS; i++){
+    for (struct func *f = funcs[i]; f != NULL; f = f->next){
+      printf("%s() {", f->name);
+      for (int j = 0; j < f->ncmds; j++){
+        for (char **word = f->cmds[j]; *word != NULL; word++)
+          printf(" %s", *word);
+        printf(";");
+      }
+      puts(" }");
+    }
+  }
+}
+
+//finds the "}" that ends a function body, NULL if it is not there yet
+static char *find_close(char *body){
+  for (char *temp = body; *temp != '\0'; temp++){
+    if (*temp != '}')
+      continue;
+    //has to be a word on its own
+    if ((temp == body || strchr(" \t\n;", temp[-1])) && (temp[1] == '\0' || strchr(" \t\n;", temp[1])))
+      return temp;
+  }
+  return NULL;
+}
+
+//checks if line starts a function definition "name() { cmd; cmd; }" and stores it
+//if the "}" is not on the same line, more lines are read from file (or the terminal if file is NULL)
+//returns FALSE if line is not a definition
+int define_function(char *line, FILE *file){
+  if (line == NULL)
+    return FALSE;
+  //name
+  char *temp = line;
+  while (*temp == ' ' || *temp == '\t')
+    temp++;
+  char *name = temp;
+  while (isalnum(*temp) || *temp == '_' || *temp == '-')
+    temp++;
+  size_t len = temp - name;
+  //followed by "()" and "{"
+  while (*temp == ' ' || *temp == '\t')
+    temp++;
+  if (len == 0 || strncmp(temp, "()", 2))
+    return FALSE;
+  temp += 2;
+  while (*temp == ' ' || *temp == '\t')
+    temp++;
+  if (*temp != '{')
+    return FALSE;
+
+  //collect the body, reading more lines until the closing "}"
+  char *body = strdup(temp + 1);
+  char *end;
+  while ((end = find_close(body)) == NULL){
+    char *more;
+    char buffer[BUFF];
+    if (file != NULL)
+      more = fgets(buffer, sizeof(buffer), file) ? strdup(buffer) : NULL;
+    else
+      more = readline("> ");
+    if (more == NULL){
+      puts("Error: missing } at end of function");
+      free(body);
+      return TRUE;
+    }
+    body = realloc(body, strlen(body) + strlen(more) + 2);
+    strcat(body, "\n");
+    strcat(body, more);
+    free(more);
+  }
+  //anything after the "}" runs once the function is stored
+  char *rest = end + 1;
+  while (*rest == ' ' || *rest == '\t' || *rest == ';')
+    rest++;
+  rest = strdup(rest);
+  *end = '\0';
+
+  //split the body into commands at ";" and new lines, then into words
+  char ***cmds = NULL;
+  int ncmds = 0;
+  char *cmd_save, *word_save;
+  for (char *cmd = strtok_r(body, ";\n", &cmd_save); cmd != NULL; cmd = strtok_r(NULL, ";\n", &cmd_save)){
+    char *words[MAX_ARGS];
+    int n = 0;
+    for (char *word = strtok_r(cmd, " \t", &word_save); word != NULL; word = strtok_r(NULL, " \t", &word_save)){
+      if (n == MAX_ARGS-1){
+        puts("Error: too many args in function command");
+        break;
+      }
+      words[n++] = word;
+    }
+    //skip empty commands
+    if (n == 0)
+      continue;
+    cmds = realloc(cmds, sizeof(char **) * (ncmds + 1));
+    cmds[ncmds] = malloc(sizeof(char *) * (n + 1));
+    for (int i = 0; i < n; i++)
+      cmds[ncmds][i] = strdup(words[i]);
+    cmds[ncmds][n] = NULL;
+    ncmds++;
+  }
+  free(body);
+
+  //replace an existing function, or add a new one
+  char saved = name[len];
+  name[len] = '\0';
+  struct func *f = find_func(name);
+  if (f == NULL){
+    struct func **bucket = &funcs[hash_string(FNV_OFFSET, name) & (FUNC_BUCKETS - 1)];
+    f = calloc(1, sizeof(struct func));
+    f->name = strdup(name);
+    f->next = *bucket;
+    *bucket = f;
+  }
+  //an old body is not freed, it may still be running
+  name[len] = saved;
+  f->cmds = cmds;
+  f->ncmds = ncmds;
+
+  //run the rest of the line, which may define another function
+  if (!define_function(rest, file)){
+    char *args[MAX_ARGS];
+    parse_input(rest, args);
+    if (args[0] != NULL)
+      batch_commands(args);
+  }
+  free(rest);
+  return TRUE;
+}
+
+//replaces $0-$9, $# and $@ in a word with the function's params
+//returns word itself if there is nothing to replace, otherwise a new string
+char *expand_word(char *word, char **params, int nparams){
+  if (strchr(word, '$') == NULL)
+    return word;
+  char *result = malloc(BUFF);
+  size_t len = 0;
+  char number[16];
+  for (char *temp = word; *temp != '\0'; temp++){
+    char *value = NULL;
+    //$0 to $9
+    if (temp[0] == '$' && isdigit(temp[1])){
+      int i = temp[1] - '0';
+      value = (i <= nparams) ? params[i] : "";
+    }
+    //number of params
+    else if (temp[0] == '$' && temp[1] == '#'){
+      snprintf(number, sizeof(number), "%d", nparams);
+      value = number;
+    }
+    //every param, with spaces between
+    else if (temp[0] == '$' && (temp[1] == '@' || temp[1] == '*')){
+      for (int i = 1; i <= nparams && len < BUFF-1; i++){
+        if (i > 1)
+          result[len++] = ' ';
+        for (char *c = params[i]; *c != '\0' && len < BUFF-1; c++)
+          result[len++] = *c;
+      }
+      temp++;
+      continue;
+    }
+    //add the param's value, or the char itself
+    if (value != NULL){
+      for (char *c = value; *c != '\0' && len < BUFF-1; c++)
+        result[len++] = *c;
+      temp++;
+    }
+    else if (len < BUFF-1){
+      result[len++] = *temp;
+    }
+  }
+  result[len] = '\0';
+  return result;
+}
+
+//runs a function's commands in this shell, with args as its params
+void run_function(struct func *f, char **args){
+  //stop runaway recursion
+  if (func_depth >= FUNC_DEPTH){
+    puts("Error: functions nested too deep");
+    return;
+  }
+  func_depth++;
+  //count the params, args[0] is the function name
+  int nparams = 0;
+  while (args[nparams+1] != NULL)
+    nparams++;
+
+  //run each command like a line from a script
+  for (int i = 0; i < f->ncmds; i++){
+    char *cmd[MAX_ARGS];
+    //strings made by expand_word(), freed after the command
+    char *made[MAX_ARGS];
+    int n = 0, nmade = 0;
+    for (char **word = f->cmds[i]; *word != NULL && n < MAX_ARGS-1; word++){
+      //"$@" on its own becomes one arg per param
+      if (!strcmp(*word, "$@") || !strcmp(*word, "$*")){
+        for (int j = 1; j <= nparams && n < MAX_ARGS-1; j++)
+          cmd[n++] = args[j];
+        continue;
+      }
+      char *temp = expand_word(*word, args, nparams);
+      if (temp != *word)
+        made[nmade++] = temp;
+      cmd[n++] = temp;
+    }
+    cmd[n] = NULL;
+    if (n > 0)
+      batch_commands(cmd);
+    //cleanup
+    for (int j = 0; j < nmade; j++)
+      free(made[j]);
+  }
+  func_depth--;
+}
+
+/*-----------------
+Helper Functions
+-------------------*/
+
+//Get shell prompt
+char *get_prompt(){
+  //holds string containing directory
+  char cwd[BUFF];
+  //copy current directory into string
+  getcwd(cwd, sizeof(cwd));
+  //get user's login
+  char *login = getpwuid(getuid())->pw_name;
+  //used for formating
+  char *temp1 = malloc(sizeof(char)* 2 * BUFF);
+  char *temp2 = malloc(sizeof(char)*BUFF);
+  //add color to strings
+  sprintf(temp1, GREEN "%s:" RESET , login);
+  sprintf(temp2, BLUE "%s>" RESET, cwd);
+  //combine strings
+  strcat(temp1, temp2);
+  //return string
+  return temp1;
+}
+
+//just get the current directory
+char *get_dir(){
+  //holds string containing directory
+  char *cwd = malloc(sizeof(char)*BUFF);
+  //copy current directory into string
+  getcwd(cwd, sizeof(cwd));
+  //return cwd
+  return cwd;
+}
+/*-----------------
+Built-In commands
+(cd, clr, ls, ect.)
+-------------------*/
+
+//change the current directory
+void change_dir(char *newdir){
+  //change current directory to input string
+  if(chdir(newdir)){
+    //if change_dir() failed
+    puts("Error: directory not found");
+  }
+}
+
+//list contentents of the directory
+void list_dir(char **args, FILE *out){
+  //get next arg
+  args++;
+  //holds current file's name
+  char *temp;
+  //holds size
+  int size = 2;
+  //holds all elements in dir as a string
+  char *buffer = malloc(sizeof(char)*size);
+  //directory struct
+  DIR *d;
   struct dirent *dir;
   //open directory
   d = opendir(".");
@@ -581,12 +3146,12 @@ void list_dir(char **args){
         //and no "-a" arg 
         if (*args != NULL && !strcmp(*args, "-a") != 0){
           //print filename
-          printf("%s\n", dir->d_name);
+          fprintf(out, "%s\n", dir->d_name);
         }
       }
       //else just print the filename
       else{
-        printf("%s\n", dir->d_name);
+        fprintf(out, "%s\n", dir->d_name);
       }
     }//end while
 
@@ -601,27 +3166,27 @@ void clear(){
 }
 
 //returns the input as a string
-void echo(char **args){
+void echo(char **args, FILE *out){
   //skip "echo" part of command
   args++;
   
   //make sure there is text to output
-  if (args!= NULL){
+  if (*args != NULL){
     //print first arg
-    printf("%s", *args);
+    fprintf(out, "%s", *args);
     //move to next arg
     args++;
 
     //loop until end of args
     while (*args != NULL){
       //print current arg
-      printf(" %s", *args);
+      fprintf(out, " %s", *args);
       //move to next arg
       args++;
     }
   }
   //new line
-  puts("");
+  fputc('\n', out);
 }
 
 //exit the program
@@ -630,50 +3195,75 @@ void escape(){
 }
 
 //list environment variable
-void environ(){
+void environ_cmd(FILE *out){
   //get PATH variable
   const char *s = getenv("PATH");
   //if path is NULL
   if (s == NULL){
-    puts("PATH not found");
+    fputs("PATH not found\n", out);
   }
   //else print out path
   else{
-    printf("PATH = %s\n", s);
+    fprintf(out, "PATH = %s\n", s);
   }
 }
 
 //displays a list of commands
-void help(){
-puts(" _________________________________________________________________________________________");
-puts("|   Command      |                       Purpose                                          |");
-puts("|_________________________________________________________________________________________|");
-puts("| cd, chdir      | Changes current directory                                              |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| clear, clr     | Clears the terminal                                                    |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| echo           | Prints out the rest of the args                                        |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| environ        | Prints out the current environment variables                           |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| exit, quit     | Exit the shell                                                         |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| ls, dir        | Outputs the contents of the current directory. Files beginning with \".\"|");
-puts("|                |    hidden unless the \"-a\" arg is used                                  |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| pause          | Pauses the shell untill the enter key is pressed.                      |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| f1 | f2        | Pipes the output from f1 into f2                                       |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| f < input      | Redirects f's input to input                                           |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| f > output     | Redirects f's output to output                                         |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| f >> output    | Appends f's output to output                                           |");
-puts("|-----------------------------------------------------------------------------------------|");
-puts("| script.sh      | Will attempt to find a .sh file named script, and execute it's commands|");
-puts("|_________________________________________________________________________________________|");
-puts("\nThe shell will attempt to run external commands using the exec function");
+void help(FILE *out){
+fputs(" _________________________________________________________________________________________\n", out);
+fputs("|   Command      |                       Purpose                                          |\n", out);
+fputs("|_________________________________________________________________________________________|\n", out);
+fputs("| cd, chdir      | Changes current directory                                              |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| clear, clr     | Clears the terminal                                                    |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| echo           | Prints out the rest of the args                                        |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| environ        | Prints out the current environment variables                           |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| exit, quit     | Exit the shell                                                         |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| ls, dir        | Outputs the contents of the current directory. Files beginning with \".\"|\n", out);
+fputs("|                |    hidden unless the \"-a\" arg is used                                  |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| pause          | Pauses the shell untill the enter key is pressed.                      |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| timeout t cmd  | Runs cmd, killing it if it runs longer than t (30, 1.5s, 250ms, 2m).   |\n", out);
+fputs("|                |    With no cmd, sets the default limit for later commands (0 = off)    |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| sched opts cmd | Runs cmd with -c cpus, -N node, -n nice, -i class[:level], -b (batch). |\n", out);
+fputs("|                |    Use on each side of a pipe to place the stages separately           |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| sched auto on  | Places the two sides of a pipe on sibling cores (\"off\" to stop)        |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| cache -- cmd   | Replays cmd's saved output if argv and inputs are unchanged. Options:  |\n", out);
+fputs("|                |    --env VAR, --in file, --mtime file, --no-stdin, --stats, --clear    |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| watch          | watch [-r] [-d time] --paths path... -- cmd reruns cmd each time a     |\n", out);
+fputs("|                |    path changes. -r watches sub directories, -d sets the quiet time    |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| alias a=cmd    | Makes a run cmd. \"alias\" lists aliases, \"unalias a\" removes one        |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| f() { ...; }   | Defines a function f, can span lines. Runs in the shell, with $1-$9,   |\n", out);
+fputs("|                |    $# and $@ set to its args. \"functions\" lists them                   |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| pipestat a|b   | Runs the pipe with a relay between stages, then prints each stage's    |\n", out);
+fputs("|                |    throughput and time spent waiting. -l also shows it while running   |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| enable         | Lists builtins. \"enable -f lib.so name\" loads a builtin from a library,|\n", out);
+fputs("|                |    \"enable -d name\" removes it. See myshell_builtin.h                  |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| f1 | f2 | ...  | Pipes the output from f1 into f2, and so on                            |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| f < input      | Redirects f's input to input                                           |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| f > output     | Redirects f's output to output                                         |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| f >> output    | Appends f's output to output                                           |\n", out);
+fputs("|-----------------------------------------------------------------------------------------|\n", out);
+fputs("| script.sh      | Will attempt to find a .sh file named script, and execute it's commands|\n", out);
+fputs("|_________________________________________________________________________________________|\n", out);
+fputs("\nThe shell will attempt to run external commands using the exec function\n", out);
 }
 
 //pauses the terminal until the enter key is pressed
@@ -683,6 +3273,58 @@ void pause_cmd(){
   free (temp);
 }
 
+//converts a duration like "30", "1.5s", "250ms", "2m" or "1h" to milliseconds
+//returns -1 if the duration is not valid, too long, or too short to be a whole ms
+long parse_duration(char *arg){
+  char *end;
+  //read the number part
+  double value = strtod(arg, &end);
+  //if no number, negative, inf or nan
+  if (end == arg || !isfinite(value) || value < 0)
+    return -1;
+  //plain numbers and "s" are seconds
+  double ms;
+  if (*end == '\0' || !strcmp(end, "s"))
+    ms = value * 1000;
+  else if (!strcmp(end, "ms"))
+    ms = value;
+  else if (!strcmp(end, "m"))
+    ms = value * 60 * 1000;
+  else if (!strcmp(end, "h"))
+    ms = value * 60 * 60 * 1000;
+  //unknown suffix
+  else
+    return -1;
+  //check the range before converting, and don't let a tiny limit turn into no limit
+  if (ms > MAX_DURATION || (value > 0 && ms < 1))
+    return -1;
+  return (long)ms;
+}
+
+//runs a command with a time limit, or sets the default limit if no command is given
+void timeout_cmd(char **args){
+  //no duration, show the current default
+  if (args[1] == NULL){
+    printf("default timeout: %ldms\n", default_timeout);
+    return;
+  }
+  //get the time limit
+  long limit = parse_duration(args[1]);
+  if (limit < 0){
+    puts("Error: invalid duration");
+    return;
+  }
+  //no command, set the default for everything that follows
+  if (args[2] == NULL){
+    default_timeout = limit;
+    return;
+  }
+  //run the command with its own limit
+  cmd_timeout = limit;
+  process_input(args+2);
+  cmd_timeout = -1;
+}
+
 void test(){
   //testing clear
   puts("Blah blag b\nlah lalala You should\n't \tsee\nany of \t\t\t\tthis\n stuff");
@@ -694,10 +3336,10 @@ void test(){
   puts("-----------------------------\nTesting prompt, ls, and cd\n-----------------------------");
   printf("%s\n", get_prompt());
   change_dir("..");
-  list_dir(b);
+  list_dir(b, stdout);
   printf("%s\n", get_prompt());
   change_dir("./MyShell");
-  list_dir(a);
+  list_dir(a, stdout);
   printf("%s\n", get_prompt());
 
 
@@ -787,6 +3429,12 @@ void shell_loop(){
     //get input
     input = readline(prompt);
     add_history(input);
+    //function definitions are stored, not run
+    if (define_function(input, NULL)){
+      free(input);
+      free(prompt);
+      continue;
+    }
     //parse the input
     parse_input(input, args);
     //check for shell script file ".sh"
@@ -806,27 +3454,18 @@ void shell_loop(){
     
     //if pipe command was detected
     if (piped == TRUE){
-      //fork
-      pid_t pipe_pid = fork();
-      //if fork failed
-      if (pipe_pid < 0){
-        puts("fork failed");
-        exit(0);
-      }
-      //if child
-      else if (pipe_pid == 0){
-        //run piped commands
-        piping(args);
-      } 
-      //else parent
-      else{
-        //wait for child to finish
-        waitpid(pipe_pid, &status, 0);
-      }
+      //run piped commands
+      piping(args);
     }//end if
 
+    //if I/O redirection on a loaded builtin, no fork needed
+    else if ((input_redir == TRUE || output_redir == TRUE || append_redir == TRUE) && is_plugin(args[0])){
+      plugin_redirect(args);
+    }
     //if I/O redirection was found
     else if (input_redir == TRUE || output_redir == TRUE || append_redir == TRUE){
+      //write anything buffered, or it ends up in the output file
+      fflush(stdout);
       //fork
       pid_t io_pid = fork();
       //if fork failed
@@ -858,7 +3497,46 @@ void shell_loop(){
   }
 }
 
+//milliseconds between two times, for --startup-profile
+static double elapsed(struct timespec *from, struct timespec *to){
+  return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
 int main(int argc, char **argv){
+  //times for --startup-profile
+  struct timespec times[4];
+  clock_gettime(CLOCK_MONOTONIC, &times[0]);
+  int profile = (argc > 1 && !strcmp(argv[1], "--startup-profile"));
+  if (profile){
+    argc--;
+    argv++;
+  }
+
+  //set up builtin commands
+  init_builtins();
+  clock_gettime(CLOCK_MONOTONIC, &times[1]);
+  //map the prebuilt tables, or rebuild them for next time
+  int loaded = load_snapshot();
+  if (!loaded){
+    rebuild_snapshot();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &times[2]);
+  //complete command names from the tables
+  rl_attempted_completion_function = complete_command;
+  clock_gettime(CLOCK_MONOTONIC, &times[3]);
+
+  //show where startup time went
+  if (profile){
+    fprintf(stderr, "startup profile:\n");
+    fprintf(stderr, "  builtins  %8.3f ms\n", elapsed(&times[0], &times[1]));
+    if (loaded)
+      fprintf(stderr, "  snapshot  %8.3f ms (%u commands)\n", elapsed(&times[1], &times[2]), snap.header->nentries);
+    else
+      fprintf(stderr, "  snapshot  %8.3f ms (stale, rebuilding in background)\n", elapsed(&times[1], &times[2]));
+    fprintf(stderr, "  readline  %8.3f ms\n", elapsed(&times[2], &times[3]));
+    fprintf(stderr, "  total     %8.3f ms\n", elapsed(&times[0], &times[3]));
+  }
+
   //if there are batch commands
   if(argc > 1){
     //run commands
@@ -869,4 +3547,4 @@ int main(int argc, char **argv){
   //test();
   //start main loop of shell
   shell_loop();
-}
\ No newline at end of file
+}
@@ -0,0 +1,40 @@
+/*-----------------
+MyShell loadable builtin ABI
+
+Builtins can be loaded into a running shell with:
+
+  enable -f ./lib.so name [name ...]
+
+For every name, the library must export a function called myshell_<name>
+with the myshell_builtin_fn signature, and the library must export
+myshell_builtin_abi set to MYSHELL_BUILTIN_ABI. The function runs inside
+the shell process, so it must not exit() and must clean up after itself.
+All I/O should go through the fds it is given, which already have any
+"<", ">" or ">>" redirection applied. The return value is the exit status.
+
+Example (build with gcc -shared -fPIC -o hello.so hello.c):
+
+  #include <string.h>
+  #include <unistd.h>
+  #include "myshell_builtin.h"
+
+  MYSHELL_BUILTIN_EXPORT_ABI;
+
+  int myshell_hello(int argc, char **argv, int in_fd, int out_fd, int err_fd){
+    write(out_fd, "hello\n", 6);
+    return 0;
+  }
+-------------------*/
+#ifndef MYSHELL_BUILTIN_H
+#define MYSHELL_BUILTIN_H
+
+//bump when the calling convention changes
+#define MYSHELL_BUILTIN_ABI 1
+
+//argv is NULL terminated, argv[0] is the builtin's name
+typedef int (*myshell_builtin_fn)(int argc, char **argv, int in_fd, int out_fd, int err_fd);
+
+//put this once in every builtin library
+#define MYSHELL_BUILTIN_EXPORT_ABI int myshell_builtin_abi = MYSHELL_BUILTIN_ABI
+
+#endif